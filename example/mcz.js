@@ -0,0 +1,82 @@
+// Reference decoder for frames compressed with `minicap -c`, which is
+// signaled by bit 1 (value 2) of banner byte 24. Returns the raw I420, NV12
+// or gray payload as described by the frame header.
+//
+//   var decompress = require('./mcz')
+//   var yuv = decompress(frameBody)
+//
+// The format is documented in jni/minicap/FrameCompressor.hpp.
+
+function decompress(input) {
+  if (input[0] !== 1) {
+    throw new Error('Unsupported compressed frame version ' + input[0])
+  }
+
+  var count = input.readUInt16LE(2)
+  var output = new Buffer(input.readUInt32LE(4))
+  var entry = 8
+  var cursor = 8 + count * 12
+  var offset = 0
+
+  for (var i = 0; i < count; ++i, entry += 12) {
+    var length = input.readUInt32LE(entry)
+    var row = input.readUInt32LE(entry + 4)
+    var encodedLength = input.readUInt32LE(entry + 8)
+    var end = cursor + encodedLength
+
+    if (encodedLength === length) {
+      // Stored verbatim.
+      input.copy(output, offset, cursor, end)
+    }
+    else {
+      decodeSegment(input, cursor, end, output, offset, length, row)
+    }
+
+    cursor = end
+    offset += length
+  }
+
+  return output
+}
+
+function decodeSegment(input, cursor, end, output, start, length, row) {
+  var i = 0
+
+  // Undo the prediction as the residuals come in.
+  function put(residual) {
+    var predicted = i >= row ? output[start + i - row] :
+      i > 0 ? output[start + i - 1] : 0
+    output[start + i] = (predicted + residual) & 0xFF
+    i += 1
+  }
+
+  while (cursor < end && i < length) {
+    var token = input[cursor++]
+    var n
+
+    if (token < 0x80) {
+      for (n = token + 1; n > 0; --n) {
+        put(input[cursor++])
+      }
+    }
+    else {
+      if (token === 0xFF) {
+        n = input.readUInt16LE(cursor)
+        cursor += 2
+      }
+      else {
+        n = token - 0x80 + 3
+      }
+
+      for (var value = input[cursor++]; n > 0; --n) {
+        put(value)
+      }
+    }
+  }
+
+  if (i !== length) {
+    throw new Error('Corrupt compressed segment')
+  }
+}
+
+module.exports = decompress
@@ -0,0 +1,173 @@
+// Reference receiver for minicap's UDP transport (-U). Puts frames back
+// together from their packets, drops the ones that lost a packet instead
+// of waiting for it, and reports once a second. With an output path the
+// payload of the newest complete frame is written there, which for JPEG
+// streams is an image you can look at.
+//
+//   node rtp-receiver.js <port> [<output path>]
+//
+// See RtpSender.hpp in jni/minicap for the packet format.
+var dgram = require('dgram')
+  , fs = require('fs')
+
+var RTP_HEADER_SIZE = 12
+var FRAGMENT_HEADER_SIZE = 8
+var FRAME_HEADER_SIZE = 32
+
+// Incomplete frames kept around for late packets. Anything older than a
+// complete frame is dropped right away regardless.
+var MAX_PENDING = 8
+
+var FORMATS = ['I420', 'NV12', 'JPEG', 'PNG', 'GRAY', 'RGBA']
+
+var port = parseInt(process.argv[2], 10)
+var output = process.argv[3]
+
+if (!port) {
+  console.error('Usage: node rtp-receiver.js <port> [<output path>]')
+  process.exit(1)
+}
+
+var ssrc = null
+var lastSequence = null
+var lastFrameId = null
+var pending = {}
+
+var stats = {
+  frames: 0
+, dropped: 0
+, packets: 0
+, lost: 0
+}
+
+// Whether frame id a comes after b, allowing for wraparound.
+function newer(a, b) {
+  var diff = (a - b) >>> 0
+  return diff !== 0 && diff < 0x80000000
+}
+
+function reset() {
+  lastSequence = null
+  lastFrameId = null
+  pending = {}
+}
+
+function deliver(id, data) {
+  // Whatever is older and still incomplete would only be shown late.
+  Object.keys(pending).forEach(function(key) {
+    if (newer(id, parseInt(key, 10))) {
+      stats.dropped += 1
+      delete pending[key]
+    }
+  })
+
+  delete pending[id]
+  lastFrameId = id
+  stats.frames += 1
+
+  if (data.length < FRAME_HEADER_SIZE || data[0] < FRAME_HEADER_SIZE) {
+    console.warn('Frame %d is too short for a frame header', id)
+    return
+  }
+
+  var header = {
+    format: data[2]
+  , sequence: data.readUInt32LE(4)
+  , width: data.readUInt32LE(16)
+  , height: data.readUInt32LE(20)
+  }
+  var payload = data.slice(data[0])
+
+  if (process.env.VERBOSE) {
+    console.info('frame %d: %s %dx%d, %d bytes', header.sequence,
+      FORMATS[header.format] || header.format, header.width, header.height,
+      payload.length)
+  }
+
+  if (output) {
+    fs.writeFileSync(output + '.tmp', payload)
+    fs.renameSync(output + '.tmp', output)
+  }
+}
+
+var socket = dgram.createSocket('udp4')
+
+socket.on('message', function(packet) {
+  if (packet.length < RTP_HEADER_SIZE + FRAGMENT_HEADER_SIZE ||
+      (packet[0] >> 6) !== 2) {
+    return
+  }
+
+  // A restarted sender starts counting over.
+  var source = packet.readUInt32BE(8)
+  if (source !== ssrc) {
+    ssrc = source
+    reset()
+  }
+
+  stats.packets += 1
+
+  var sequence = packet.readUInt16BE(2)
+  if (lastSequence !== null) {
+    var gap = (sequence - lastSequence - 1) & 0xFFFF
+    // Otherwise it's a reordered packet rather than a gap.
+    if (gap < 0x8000) {
+      stats.lost += gap
+      lastSequence = sequence
+    }
+  }
+  else {
+    lastSequence = sequence
+  }
+
+  var id = packet.readUInt32BE(12)
+  var index = packet.readUInt16BE(16)
+  var count = packet.readUInt16BE(18)
+
+  // Already shown something newer.
+  if (lastFrameId !== null && !newer(id, lastFrameId)) {
+    return
+  }
+
+  var frame = pending[id]
+  if (!frame) {
+    frame = pending[id] = {
+      count: count
+    , received: 0
+    , fragments: new Array(count)
+    }
+  }
+
+  if (index >= frame.count || frame.fragments[index]) {
+    return
+  }
+
+  frame.fragments[index] = packet.slice(RTP_HEADER_SIZE + FRAGMENT_HEADER_SIZE)
+  frame.received += 1
+
+  if (frame.received === frame.count) {
+    deliver(id, Buffer.concat(frame.fragments))
+    return
+  }
+
+  var keys = Object.keys(pending)
+  if (keys.length > MAX_PENDING) {
+    var oldest = keys.reduce(function(a, b) {
+      return newer(parseInt(a, 10), parseInt(b, 10)) ? b : a
+    })
+    stats.dropped += 1
+    delete pending[oldest]
+  }
+})
+
+socket.on('listening', function() {
+  console.info('Listening on UDP port %d', port)
+})
+
+socket.bind(port)
+
+setInterval(function() {
+  console.info('%d fps, %d frames dropped, %d of %d packets lost',
+    stats.frames, stats.dropped, stats.lost, stats.packets + stats.lost)
+  stats.frames = stats.dropped = stats.packets = stats.lost = 0
+}, 1000)
@@ -1,6 +1,7 @@
 #ifndef MINICAP_HPP
 #define MINICAP_HPP
 
+#include <cstddef>
 #include <cstdint>
 
 class Minicap {
@@ -86,6 +87,33 @@ public:
   virtual int
   consumePendingFrame(Frame* frame) = 0;
 
+  // Consumes the newest of the given number of pending frames, releasing
+  // the older ones without handing them out, and optionally reports how
+  // many were skipped. Not virtual on purpose: the backends are prebuilt
+  // per SDK level and their vtables cannot grow.
+  int
+  consumeLatestFrame(Frame* frame, int pending, int* skipped = NULL) {
+    int dropped = 0;
+    int err = 0;
+
+    while (err == 0 && pending-- > 1) {
+      if ((err = consumePendingFrame(frame)) == 0) {
+        releaseConsumedFrame(frame);
+        dropped += 1;
+      }
+    }
+
+    if (err == 0) {
+      err = consumePendingFrame(frame);
+    }
+
+    if (skipped != NULL) {
+      *skipped = dropped;
+    }
+
+    return err;
+  }
+
   // Peek behind the scenes to see which capture method is actually
   // being used.
   virtual CaptureMethod
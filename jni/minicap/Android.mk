@@ -4,8 +4,29 @@ include $(CLEAR_VARS)
 LOCAL_MODULE := minicap-common
 
 LOCAL_SRC_FILES := \
+	CommandReader.cpp \
+	DisplayStream.cpp \
+	FlightRecorder.cpp \
+	FrameCompressor.cpp \
+	FramePool.cpp \
+	FrameWaiter.cpp \
+	FramebufferMinicap.cpp \
+	HttpRequest.cpp \
 	JpgEncoder.cpp \
+	Metrics.cpp \
+	PngEncoder.cpp \
+	PrefetchingMinicap.cpp \
+	RateController.cpp \
+	Recorder.cpp \
+	RtpSender.cpp \
+	ScreenshotEncoder.cpp \
+	ScrollDetector.cpp \
 	SimpleServer.cpp \
+	Simulcast.cpp \
+	ThreadPolicy.cpp \
+	Tracer.cpp \
+	WebSocket.cpp \
+	WorkerPool.cpp \
 	minicap.cpp \
 
 LOCAL_STATIC_LIBRARIES := \
@@ -16,6 +37,9 @@ LOCAL_SHARED_LIBRARIES := \
 	minicap-shared \
 	
 
+# PNG screenshots use the system zlib.
+LOCAL_EXPORT_LDLIBS := -lz
+
 include $(BUILD_STATIC_LIBRARY)
 
 include $(CLEAR_VARS)
@@ -0,0 +1,143 @@
+#include "CommandReader.hpp"
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <sstream>
+
+#include "WebSocket.hpp"
+#include "util/debug.h"
+
+CommandReader::CommandReader(int fd)
+  : mFd(fd),
+    mWebSocket(false),
+    mDiscarding(false) {
+}
+
+bool
+CommandReader::decodeFrames() {
+  WebSocket::Opcode opcode;
+  bool fin;
+  std::string payload;
+  long size;
+
+  while ((size = WebSocket::parseFrame(mFrames, opcode, fin, payload)) > 0) {
+    mFrames.erase(0, size);
+
+    switch (opcode) {
+    case WebSocket::OPCODE_CONTINUATION:
+    case WebSocket::OPCODE_TEXT:
+    case WebSocket::OPCODE_BINARY:
+      if (!mDiscarding) {
+        mMessage += payload;
+      }
+
+      if (mMessage.size() > MAX_LINE_LENGTH) {
+        MCWARN("Dropping overlong command message");
+        mMessage.clear();
+        mDiscarding = true;
+      }
+
+      if (mDiscarding) {
+        mDiscarding = !fin;
+        break;
+      }
+
+      // Every message ends a command, newline or not.
+      if (fin) {
+        mBuffer += mMessage;
+        mBuffer += '\n';
+        mMessage.clear();
+      }
+      break;
+    case WebSocket::OPCODE_PING: {
+      unsigned char header[WEBSOCKET_MAX_HEADER_SIZE];
+      size_t headerSize = WebSocket::putHeader(header, WebSocket::OPCODE_PONG, payload.size());
+      payload.insert(0, reinterpret_cast<char*>(header), headerSize);
+      send(mFd, payload.data(), payload.size(), MSG_NOSIGNAL);
+      break;
+    }
+    case WebSocket::OPCODE_CLOSE:
+      return false;
+    default:
+      break;
+    }
+  }
+
+  return size == 0;
+}
+
+bool
+CommandReader::readAvailable() {
+  char chunk[256];
+
+  while (true) {
+    ssize_t got = recv(mFd, chunk, sizeof(chunk), MSG_DONTWAIT);
+
+    if (got == 0) {
+      return false;
+    }
+
+    if (got < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return true;
+      }
+
+      // Not a socket (e.g. stdin), fall back to a plain read. The caller
+      // is expected to have made the descriptor non-blocking.
+      if (errno == ENOTSOCK) {
+        got = read(mFd, chunk, sizeof(chunk));
+        if (got == 0) {
+          return false;
+        }
+        if (got < 0) {
+          return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+      }
+      else {
+        return false;
+      }
+    }
+
+    if (mWebSocket) {
+      mFrames.append(chunk, got);
+
+      if (!decodeFrames()) {
+        return false;
+      }
+    }
+    else {
+      mBuffer.append(chunk, got);
+    }
+
+    if (mBuffer.size() > MAX_LINE_LENGTH && mBuffer.find('\n') == std::string::npos) {
+      MCWARN("Dropping overlong command line");
+      mBuffer.clear();
+    }
+  }
+}
+
+bool
+CommandReader::nextCommand(Command& command) {
+  size_t end;
+
+  while ((end = mBuffer.find('\n')) != std::string::npos) {
+    std::istringstream line(mBuffer.substr(0, end));
+    mBuffer.erase(0, end + 1);
+
+    command.clear();
+
+    std::string word;
+    while (line >> word) {
+      command.push_back(word);
+    }
+
+    // Skip blank lines.
+    if (!command.empty()) {
+      return true;
+    }
+  }
+
+  return false;
+}
@@ -0,0 +1,55 @@
+#ifndef MINICAP_COMMAND_READER_HPP
+#define MINICAP_COMMAND_READER_HPP
+
+#include <string>
+#include <vector>
+
+// Splits a stream of newline-terminated text commands coming from a client
+// into words, without ever blocking the frame loop. Example: "crop 0,0,720,400".
+class CommandReader {
+public:
+  typedef std::vector<std::string> Command;
+
+  CommandReader(int fd);
+
+  // Commands arrive in WebSocket messages rather than as a plain stream.
+  // Pings are answered along the way.
+  void
+  setWebSocket(bool webSocket) {
+    mWebSocket = webSocket;
+  }
+
+  // Reads whatever is currently available on the descriptor. Returns false
+  // once the peer has closed its end or an error occurred.
+  bool
+  readAvailable();
+
+  // Pops the next complete command, if any.
+  bool
+  nextCommand(Command& command);
+
+  int
+  getFd() {
+    return mFd;
+  }
+
+private:
+  static const size_t MAX_LINE_LENGTH = 1024;
+
+  int mFd;
+  bool mWebSocket;
+  // Undecoded WebSocket frames.
+  std::string mFrames;
+  std::string mMessage;
+  // The message being received is too long, and its remaining fragments
+  // are skipped.
+  bool mDiscarding;
+  std::string mBuffer;
+
+  // Moves the payloads of complete messages from mFrames to mBuffer.
+  // Returns false once the peer closes or misbehaves.
+  bool
+  decodeFrames();
+};
+
+#endif
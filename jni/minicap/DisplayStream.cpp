@@ -0,0 +1,1593 @@
+#include "DisplayStream.hpp"
+
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "FramebufferMinicap.hpp"
+#include "Metrics.hpp"
+#include "PrefetchingMinicap.hpp"
+#include "ThreadPolicy.hpp"
+#include "Tracer.hpp"
+#include "WebSocket.hpp"
+#include "util/debug.h"
+
+enum {
+  QUIRK_DUMB            = 1,
+  QUIRK_ALWAYS_UPRIGHT  = 2,
+  QUIRK_TEAR            = 4,
+};
+
+// How long to wait for a request while holding a frame for pull clients,
+// before checking for a newer frame again.
+#define PULL_POLL_MS 10
+
+// How long to wait for a client while idle, before checking for a newer
+// frame again.
+#define IDLE_POLL_MS 100
+
+// How long to wait for a new frame, before checking for clients and
+// commands again.
+#define FRAME_POLL_MS 100
+
+// Recorded frames go out a few at a time between live ones, so that a
+// replay doesn't hold up the stream.
+#define REPLAY_POLL_MS 10
+#define REPLAY_BYTES_PER_PASS (256 * 1024)
+
+// How long a new client gets to start an HTTP request before it's taken
+// to be a raw protocol client, and how long it then gets to finish it.
+#define HTTP_SNIFF_MS 50
+#define HTTP_READ_MS 2000
+
+// How often connections are checked on while they're being told apart.
+#define PENDING_POLL_MS 10
+
+// Where MJPEG viewers find the stream, which they get as a multipart
+// response where every part replaces the previous one.
+#define MJPEG_PATH "/stream.mjpeg"
+#define MJPEG_BOUNDARY "minicapframe"
+
+// Whether the socket has room for more without blocking.
+static bool
+writable(int fd) {
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+  pfd.revents = 0;
+
+  return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLOUT);
+}
+
+static int
+pumps(int fd, unsigned char* data, size_t length) {
+  do {
+    // Make sure that we don't generate a SIGPIPE even if the socket doesn't
+    // exist anymore. We'll still get an EPIPE which is perfect.
+    int wrote = send(fd, data, length, MSG_NOSIGNAL);
+
+    if (wrote < 0) {
+      return wrote;
+    }
+
+    data += wrote;
+    length -= wrote;
+  }
+  while (length > 0);
+
+  return 0;
+}
+
+// Sends all vectors, IOV_MAX at a time. Modifies them along the way.
+static int
+pumpv(int fd, struct iovec* iov, int count) {
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+
+  while (count > 0) {
+    msg.msg_iov = iov;
+    msg.msg_iovlen = std::min(count, IOV_MAX);
+
+    ssize_t wrote = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+    if (wrote < 0) {
+      return wrote;
+    }
+
+    // Skip whatever went out, partially written vectors included.
+    while (count > 0 && static_cast<size_t>(wrote) >= iov->iov_len) {
+      wrote -= iov->iov_len;
+      iov++;
+      count--;
+    }
+
+    if (count > 0) {
+      iov->iov_base = static_cast<unsigned char*>(iov->iov_base) + wrote;
+      iov->iov_len -= wrote;
+    }
+  }
+
+  return 0;
+}
+
+// Frames are prefixed by their length for raw clients, and make up one
+// binary message each for WebSocket ones. Returns the prefix size.
+#define MAX_PREFIX_SIZE WEBSOCKET_MAX_HEADER_SIZE
+
+static size_t
+put_prefix(unsigned char* out, size_t length, bool webSocket) {
+  if (webSocket) {
+    return WebSocket::putHeader(out, WebSocket::OPCODE_BINARY, length);
+  }
+
+  putUInt32LE(out, length);
+  return 4;
+}
+
+// Sends rows [first, first + rows) of a raw picture as a strip frame,
+// straight from the planes. Returns the number of bytes sent.
+static int
+send_strip(int fd, const FrameHeader& header, unsigned char* data,
+    uint32_t first, uint32_t rows, bool webSocket) {
+  unsigned char head[MAX_PREFIX_SIZE + FRAME_HEADER_SIZE + STRIP_RECORD_SIZE];
+  size_t width = header.width;
+  size_t lumaSize = width * header.height;
+  struct iovec iov[4];
+  int count = 1;
+  size_t size = STRIP_RECORD_SIZE;
+
+  iov[count].iov_base = data + first * width;
+  iov[count++].iov_len = rows * width;
+
+  switch (header.format) {
+  case FRAME_FORMAT_I420:
+    iov[count].iov_base = data + lumaSize + first / 2 * width / 2;
+    iov[count++].iov_len = rows / 2 * width / 2;
+    iov[count].iov_base = data + lumaSize * 5 / 4 + first / 2 * width / 2;
+    iov[count++].iov_len = rows / 2 * width / 2;
+    break;
+  case FRAME_FORMAT_NV12:
+    iov[count].iov_base = data + lumaSize + first / 2 * width;
+    iov[count++].iov_len = rows / 2 * width;
+    break;
+  }
+
+  for (int i = 1; i < count; ++i) {
+    size += iov[i].iov_len;
+  }
+
+  size_t prefixSize = put_prefix(head, FRAME_HEADER_SIZE + size, webSocket);
+  header.serialize(head + prefixSize);
+  putUInt32LE(head + prefixSize + FRAME_HEADER_SIZE, first);
+  putUInt32LE(head + prefixSize + FRAME_HEADER_SIZE + 4, rows);
+
+  iov[0].iov_base = head;
+  iov[0].iov_len = prefixSize + FRAME_HEADER_SIZE + STRIP_RECORD_SIZE;
+
+  StageTimer timer(gMetrics.sendTime);
+
+  if (pumpv(fd, iov, count) < 0) {
+    return -1;
+  }
+
+  timer.stop();
+  gMetrics.bytesSent.add(prefixSize + FRAME_HEADER_SIZE + size);
+
+  if (first + rows == header.height) {
+    gMetrics.framesSent.add();
+  }
+
+  return prefixSize + FRAME_HEADER_SIZE + size;
+}
+
+// Sends a frame prefixed by its length and, if enabled, its header.
+// Returns the number of bytes sent.
+static int
+send_frame(int fd, const EncodedFrame& frame, bool withHeader, bool webSocket) {
+  unsigned char header[MAX_PREFIX_SIZE + FRAME_HEADER_SIZE];
+  size_t headerSize = put_prefix(header,
+    (withHeader ? FRAME_HEADER_SIZE : 0) + frame.size, webSocket);
+
+  if (withHeader) {
+    frame.header.serialize(header + headerSize);
+    headerSize += FRAME_HEADER_SIZE;
+  }
+
+  StageTimer timer(gMetrics.sendTime);
+
+  if (pumps(fd, header, headerSize) < 0 || pumps(fd, frame.data, frame.size) < 0) {
+    return -1;
+  }
+
+  timer.stop();
+  gMetrics.framesSent.add();
+  gMetrics.bytesSent.add(headerSize + frame.size);
+
+  return headerSize + frame.size;
+}
+
+// Starts the multipart response for an MJPEG viewer.
+static bool
+start_mjpeg(int fd) {
+  static const char response[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: multipart/x-mixed-replace; boundary=" MJPEG_BOUNDARY "\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Connection: close\r\n\r\n";
+
+  return send(fd, response, sizeof(response) - 1, MSG_NOSIGNAL) ==
+    static_cast<ssize_t>(sizeof(response) - 1);
+}
+
+// Sends a JPEG frame as the next part to an MJPEG viewer. Returns the
+// number of bytes sent.
+static int
+send_part(int fd, const EncodedFrame& frame) {
+  char head[128];
+  int headSize = snprintf(head, sizeof(head),
+    "--" MJPEG_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %lu\r\n\r\n",
+    static_cast<unsigned long>(frame.size));
+
+  struct iovec iov[3];
+  iov[0].iov_base = head;
+  iov[0].iov_len = headSize;
+  iov[1].iov_base = frame.data;
+  iov[1].iov_len = frame.size;
+  iov[2].iov_base = const_cast<char*>("\r\n");
+  iov[2].iov_len = 2;
+
+  StageTimer timer(gMetrics.sendTime);
+
+  if (pumpv(fd, iov, 3) < 0) {
+    return -1;
+  }
+
+  timer.stop();
+  gMetrics.framesSent.add();
+  gMetrics.bytesSent.add(headSize + frame.size + 2);
+
+  return headSize + frame.size + 2;
+}
+
+// Whether MJPEG viewers can be served from the stream format, which needs
+// I420 planes to compress.
+static bool
+mjpeg_supported(unsigned int format) {
+  return format == FRAME_FORMAT_I420 || format == FRAME_FORMAT_NV12 ||
+    format == FRAME_FORMAT_JPG;
+}
+
+// The I420 planes of a raw frame.
+static YuvFrame
+i420_view(const EncodedFrame& frame) {
+  YuvFrame planes;
+  planes.width = frame.header.width;
+  planes.height = frame.header.height;
+  planes.size = frame.size;
+  planes.data = frame.data;
+  planes.y = frame.data;
+  planes.u = planes.y + planes.width * planes.height;
+  planes.v = planes.u + planes.width * planes.height / 4;
+  return planes;
+}
+
+static uint32
+format_fourcc(unsigned int format) {
+  switch (format) {
+  case FRAME_FORMAT_I420:
+  // Compressed from the I420 output.
+  case FRAME_FORMAT_JPG:
+    return FOURCC_I420;
+  case FRAME_FORMAT_GRAY:
+  // Not converted at all, keep the encoder small.
+  case FRAME_FORMAT_RGBA:
+    return FOURCC_I400;
+  default:
+    return FOURCC_NV12;
+  }
+}
+
+DisplayStream::DisplayStream(const DisplayConfig& config, FramePool& framePool)
+  : mConfig(config),
+    mFramePool(framePool),
+    mEncoder(format_fourcc(config.format)),
+    mSimulcast(format_fourcc(config.format), config.renditions),
+    mJpg(0, 0),
+    mRate(config.targetLatency, config.quality),
+    mDownscale(1),
+    mBackend(NULL),
+    mMinicap(NULL),
+    mQuirks(0),
+    mSequence(0),
+    mIdleSince(0),
+    mAttached(true),
+    mStale(false),
+    mRecorder(NULL),
+    mFlightRecorder(NULL),
+    mRtpSender(NULL),
+    mUnconvertible(0),
+    mOutputWidth(0),
+    mOutputHeight(0),
+    mRecapture(false) {
+  memset(mBanner, 0, sizeof(mBanner));
+}
+
+DisplayStream::~DisplayStream() {
+  if (mMinicap != mBackend) {
+    delete mMinicap;
+  }
+
+  if (mBackend != NULL) {
+    minicap_free(mBackend);
+  }
+}
+
+const char*
+DisplayStream::checkConfig(const DisplayConfig& config) {
+  // Strips leave before the frame is complete, so there's nothing to
+  // compress or compare yet.
+  if (config.stripRows > 0 && (config.compress || config.detectScroll)) {
+    return "-l can't be combined with -c or -e";
+  }
+
+  // Those work on raw YUV frames only.
+  if (config.format == FRAME_FORMAT_JPG &&
+      (config.stripRows > 0 || config.compress || config.detectScroll)) {
+    return "-f 2 can't be combined with -l, -c or -e";
+  }
+
+  // Nothing but the captured frame goes out.
+  if (config.format == FRAME_FORMAT_RGBA && (config.stripRows > 0 ||
+      config.compress || config.detectScroll || config.renditions.size() > 1 ||
+      config.crop.active())) {
+    return "-f 5 can't be combined with -l, -c, -e, -p or -C";
+  }
+
+  return NULL;
+}
+
+bool
+DisplayStream::setUp() {
+  FramebufferMinicap* framebuffer = NULL;
+
+  if (mConfig.framebufferPath != NULL) {
+    mMinicap = framebuffer = new FramebufferMinicap(mConfig.framebufferPath, mConfig.displayId);
+  }
+  else {
+    mMinicap = mBackend = minicap_create(mConfig.displayId);
+    if (mBackend == NULL) {
+      return false;
+    }
+  }
+
+  // Figure out the quirks the current capture method has.
+  switch (mMinicap->getCaptureMethod()) {
+  case Minicap::METHOD_FRAMEBUFFER:
+    mQuirks |= QUIRK_DUMB | QUIRK_TEAR;
+    break;
+  case Minicap::METHOD_SCREENSHOT:
+    mQuirks |= QUIRK_DUMB;
+    break;
+  case Minicap::METHOD_VIRTUAL_DISPLAY:
+    mQuirks |= QUIRK_ALWAYS_UPRIGHT;
+    break;
+  }
+
+  // Screenshot backends only capture when asked to, so let the next capture
+  // overlap with converting the current frame.
+  if (mMinicap->getCaptureMethod() == Minicap::METHOD_SCREENSHOT && mConfig.prefetch) {
+    MCINFO("Prefetching frames from the screenshot backend");
+    mMinicap = new PrefetchingMinicap(mBackend);
+  }
+
+  // Negotiate the capture size. A runtime crop switches it later on, see
+  // recapture().
+  mOutputWidth = static_cast<uint32_t>(mConfig.desiredInfo.width * mConfig.scaling + 0.5f) & ~1;
+  mOutputHeight = static_cast<uint32_t>(mConfig.desiredInfo.height * mConfig.scaling + 0.5f) & ~1;
+  mCaptureInfo = captureInfoFor(mConfig.crop.active());
+
+  MCINFO("Capturing display %d at %dx%d for %dx%d output", mConfig.displayId,
+    mCaptureInfo.width, mCaptureInfo.height, mOutputWidth, mOutputHeight);
+
+  if (mMinicap->setRealInfo(mConfig.realInfo) != 0) {
+    MCERROR("Minicap did not accept real display info");
+    return false;
+  }
+
+  if (mMinicap->setDesiredInfo(mCaptureInfo) != 0) {
+    MCERROR("Minicap did not accept desired display info");
+    return false;
+  }
+
+  mMinicap->setFrameAvailableListener(&mWaiter);
+
+  if (mMinicap->applyConfigChanges() != 0) {
+    MCERROR("Unable to start minicap with current config");
+    return false;
+  }
+
+  if (framebuffer != NULL && framebuffer->isTearFree()) {
+    mQuirks &= ~QUIRK_TEAR;
+  }
+
+  // Sized for the negotiated capture, and adjusted later should frames
+  // turn out different after all.
+  if (mConfig.needsYuv && !mEncoder.reserveData(mCaptureInfo.width, mCaptureInfo.height,
+      static_cast<float>(mOutputWidth) / mCaptureInfo.width)) {
+    MCERROR("Unable to reserve data for JPG encoder");
+    return false;
+  }
+
+  if (mConfig.needsYuv && mConfig.crop.active() && !mEncoder.setCrop(mConfig.crop)) {
+    MCERROR("Unable to crop to the requested region");
+    return false;
+  }
+
+  return true;
+}
+
+Minicap::DisplayInfo
+DisplayStream::captureInfoFor(bool cropping) const {
+  // Everything but the framebuffer scales for free (on the GPU), so ask
+  // for the output size right away and leave the CPU scaler idle. A crop
+  // wants full resolution to cut from, and PNG or JPG screenshots are
+  // taken at full size, so those don't negotiate.
+  Minicap::DisplayInfo info = mConfig.desiredInfo;
+
+  if (mMinicap->getCaptureMethod() == Minicap::METHOD_FRAMEBUFFER) {
+    info.width = mConfig.realInfo.width;
+    info.height = mConfig.realInfo.height;
+  }
+  else if (mConfig.needsYuv && !cropping) {
+    info.width = mOutputWidth;
+    info.height = mOutputHeight;
+  }
+
+  return info;
+}
+
+bool
+DisplayStream::recapture(Minicap::Frame& frame, bool& haveFrame) {
+  Minicap::DisplayInfo info = captureInfoFor(mRecrop.active());
+
+  mRecapture = false;
+
+  if (haveFrame) {
+    mMinicap->releaseConsumedFrame(&frame);
+    haveFrame = false;
+  }
+
+  MCINFO("Capturing display %d at %dx%d for %dx%d output", mConfig.displayId,
+    info.width, info.height, mOutputWidth, mOutputHeight);
+
+  if (mMinicap->setDesiredInfo(info) != 0 || mMinicap->applyConfigChanges() != 0) {
+    MCERROR("Unable to change the capture size of display %d", mConfig.displayId);
+    return false;
+  }
+
+  mCaptureInfo = info;
+
+  // Frames of the old size may still come in, fitFrame() deals with them.
+  if (!mEncoder.reserveData(info.width, info.height,
+      static_cast<float>(mOutputWidth) / info.width)) {
+    MCERROR("Unable to reserve data for %dx%d frames", info.width, info.height);
+    return false;
+  }
+
+  if (!mEncoder.setCrop(mRecrop)) {
+    MCWARN("Unable to apply crop %d,%d,%d,%d", mRecrop.x, mRecrop.y,
+      mRecrop.width, mRecrop.height);
+  }
+
+  return true;
+}
+
+bool
+DisplayStream::listen() {
+  if (mServer.start(mConfig.sockname, mConfig.port) < 0) {
+    MCERROR("Unable to start server on port %d", mConfig.port);
+    return false;
+  }
+
+  MCINFO("Streaming display %d on port %d", mConfig.displayId, mConfig.port);
+
+  // Prepare banner for clients.
+  mBanner[0] = (unsigned char) BANNER_VERSION;
+  mBanner[1] = (unsigned char) BANNER_SIZE;
+  putUInt32LE(mBanner + 2, getpid());
+  putUInt32LE(mBanner + 6, mConfig.realInfo.width);
+  putUInt32LE(mBanner + 10, mConfig.realInfo.height);
+  putUInt32LE(mBanner + 14, mConfig.desiredInfo.width);
+  putUInt32LE(mBanner + 18, mConfig.desiredInfo.height);
+  mBanner[22] = (unsigned char) mConfig.desiredInfo.orientation;
+  mBanner[23] = mQuirks;
+  mBanner[24] = (mConfig.frameHeaders ? BANNER_FLAG_FRAME_HEADER : 0) |
+    (mConfig.compress ? BANNER_FLAG_COMPRESSED : 0);
+  mBanner[26] = (unsigned char) mSimulcast.getCount();
+  mBanner[27] = 0;
+  putUInt32LE(mBanner + 28, mEncoder.crop.x);
+  putUInt32LE(mBanner + 32, mEncoder.crop.y);
+  putUInt32LE(mBanner + 36, mEncoder.crop.active() ? mEncoder.crop.width : mEncoder.rawFrame.width);
+  putUInt32LE(mBanner + 40, mEncoder.crop.active() ? mEncoder.crop.height : mEncoder.rawFrame.height);
+  putBannerFormat();
+
+  return true;
+}
+
+void
+DisplayStream::putBannerFormat() {
+  mBanner[25] = (unsigned char) mConfig.format;
+  putUInt32LE(mBanner + 44, mConfig.format == FRAME_FORMAT_RGBA
+    ? mEncoder.rawFrame.width : mEncoder.nvFrame.width);
+  putUInt32LE(mBanner + 48, mConfig.format == FRAME_FORMAT_RGBA
+    ? mEncoder.rawFrame.height : mEncoder.nvFrame.height);
+}
+
+void
+DisplayStream::handleFlightCommand(const CommandReader::Command& command, Client& client) {
+  if (mFlightRecorder == NULL) {
+    MCWARN("Flight recorder not enabled, use -m");
+    return;
+  }
+
+  if (command.size() == 3 && command[1] == "dump") {
+    mFlightRecorder->dump(command[2], mBanner, BANNER_SIZE);
+    return;
+  }
+
+  if (command.size() == 2 && command[1] == "send") {
+    // Replays are told apart from live frames by their header alone.
+    if (!mConfig.frameHeaders || client.mjpeg) {
+      MCWARN("Replaying recorded frames needs frame headers, use -H");
+      return;
+    }
+
+    std::vector<std::shared_ptr<EncodedFrame>> frames;
+    mFlightRecorder->snapshot(frames);
+
+    MCINFO("Sending %d recorded frames", (int) frames.size());
+
+    // Sent by sendReplays().
+    client.replay.assign(frames.begin(), frames.end());
+    return;
+  }
+
+  MCWARN("Invalid flight command, need \"flight dump <file name>\" or \"flight send\"");
+}
+
+void
+DisplayStream::handleCommand(const CommandReader::Command& command, Client& client) {
+  if (command[0] == "crop" && command.size() == 2) {
+    Crop crop;
+    if (command[1] != "off" && !Crop::parse(crop, command[1].c_str())) {
+      MCWARN("Invalid crop '%s'", command[1].c_str());
+      return;
+    }
+
+    // Full frames are captured at output size, so a crop in display
+    // pixels, possibly at a higher scale, needs the capture switched to
+    // full size first. That waits until no frame is being converted.
+    Minicap::DisplayInfo info = captureInfoFor(crop.active());
+
+    if (info.width != mCaptureInfo.width || info.height != mCaptureInfo.height) {
+      mRecrop = crop;
+      mRecapture = true;
+      return;
+    }
+
+    mRecapture = false;
+
+    if (!mEncoder.setCrop(crop)) {
+      MCWARN("Unable to apply crop '%s'", command[1].c_str());
+    }
+
+    return;
+  }
+
+  // Applies to every client of the stream, they can tell from the frame
+  // header.
+  if (command[0] == "format" && command.size() == 2) {
+    unsigned int format = atoi(command[1].c_str());
+
+    if (format != FRAME_FORMAT_I420 && format != FRAME_FORMAT_NV12 &&
+        format != FRAME_FORMAT_JPG && format != FRAME_FORMAT_GRAY &&
+        format != FRAME_FORMAT_RGBA) {
+      MCWARN("Invalid stream format '%s'", command[1].c_str());
+      return;
+    }
+
+    // Raw clients only learn about the change from the frame headers.
+    if (!mConfig.frameHeaders) {
+      MCWARN("Switching formats needs frame headers, use -H");
+      return;
+    }
+
+    DisplayConfig changed = mConfig;
+    changed.format = format;
+
+    const char* conflict = checkConfig(changed);
+    if (conflict != NULL) {
+      MCWARN("Unable to switch to format %d: %s", format, conflict);
+      return;
+    }
+
+    if (!mEncoder.setFourcc(format_fourcc(format))) {
+      MCWARN("Unable to switch to format %d", format);
+      return;
+    }
+
+    mSimulcast.setFourcc(format_fourcc(format));
+    mConfig.format = format;
+    putBannerFormat();
+
+    if (!mjpeg_supported(format)) {
+      for (auto& other: mClients) {
+        if (other.mjpeg && other.fd >= 0) {
+          MCINFO("Format %d can't be served as MJPEG, closing viewer", format);
+          closeClient(other);
+        }
+      }
+    }
+
+    return;
+  }
+
+  if (command[0] == "rendition" && command.size() == 2) {
+    unsigned int rendition = atoi(command[1].c_str());
+
+    if (rendition >= mSimulcast.getCount()) {
+      MCWARN("No rendition %d, there are %d", rendition, mSimulcast.getCount());
+      return;
+    }
+
+    client.rendition = rendition;
+    return;
+  }
+
+  // Pull mode: the newest frame at this point is converted and sent to
+  // this client alone, unless others want it anyway.
+  if (command[0] == "frame" && command.size() == 1) {
+    client.pull = true;
+    client.requested = true;
+    return;
+  }
+
+  if (command[0] == "push" && command.size() == 1) {
+    client.pull = false;
+    return;
+  }
+
+  if (command[0] == "flight") {
+    handleFlightCommand(command, client);
+    return;
+  }
+
+  MCWARN("Ignoring unknown command '%s'", command[0].c_str());
+}
+
+bool
+DisplayStream::acceptClient(int timeout) {
+  int fd = mServer.accept(timeout);
+  if (fd >= 0) {
+    MCINFO("New client connection on port %d", mConfig.port);
+
+    gMetrics.clientsAccepted.add();
+
+    PendingClient pending;
+    pending.fd = fd;
+    pending.deadline = monotonicTimestamp() + HTTP_SNIFF_MS * 1000;
+    pending.http = false;
+    mPending.push_back(pending);
+  }
+
+  bool admitted = false;
+
+  for (size_t i = 0; i < mPending.size();) {
+    int result = classifyClient(mPending[i]);
+
+    if (result == 0) {
+      ++i;
+    }
+    else {
+      admitted = admitted || result > 0;
+      mPending.erase(mPending.begin() + i);
+    }
+  }
+
+  return admitted;
+}
+
+int
+DisplayStream::classifyClient(PendingClient& pending) {
+  uint64_t now = monotonicTimestamp();
+  int fd = pending.fd;
+
+  // Browsers speak first.
+  if (!pending.http) {
+    HttpRequest::Sniff sniff = HttpRequest::sniff(fd);
+
+    if (sniff == HttpRequest::SNIFF_WAIT && now < pending.deadline) {
+      return 0;
+    }
+
+    if (sniff != HttpRequest::SNIFF_HTTP) {
+      return admitClient(fd, false, false) ? 1 : -1;
+    }
+
+    pending.http = true;
+    pending.deadline = now + HTTP_READ_MS * 1000;
+  }
+
+  int result = pending.request.readAvailable(fd);
+
+  if (result == 0 && now >= pending.deadline) {
+    MCWARN("Incomplete HTTP request");
+    result = -1;
+  }
+
+  if (result == 0) {
+    return 0;
+  }
+
+  if (result < 0) {
+    close(fd);
+    return -1;
+  }
+
+  const HttpRequest& request = pending.request;
+
+  if (WebSocket::isUpgrade(request)) {
+    if (!WebSocket::accept(fd, request)) {
+      close(fd);
+      return -1;
+    }
+
+    MCINFO("Client on port %d is a WebSocket", mConfig.port);
+    return admitClient(fd, true, false) ? 1 : -1;
+  }
+
+  if (request.getMethod() == "GET" && request.getPath() == MJPEG_PATH) {
+    if (!mjpeg_supported(mConfig.format)) {
+      MCWARN("MJPEG needs an I420, NV12 or JPEG stream, not format %d", mConfig.format);
+      HttpRequest::respond(fd, "503 Service Unavailable");
+      close(fd);
+      return -1;
+    }
+
+    if (!start_mjpeg(fd)) {
+      close(fd);
+      return -1;
+    }
+
+    MCINFO("Client on port %d is an MJPEG viewer", mConfig.port);
+    return admitClient(fd, false, true) ? 1 : -1;
+  }
+
+  MCWARN("Not found: %s", request.getPath().c_str());
+  HttpRequest::respond(fd, "404 Not Found");
+  close(fd);
+  return -1;
+}
+
+bool
+DisplayStream::admitClient(int fd, bool webSocket, bool mjpeg) {
+  unsigned char prefix[MAX_PREFIX_SIZE];
+  size_t prefixSize = put_prefix(prefix, BANNER_SIZE, webSocket);
+
+  // The banner has no length prefix in the raw protocol, and MJPEG viewers
+  // don't get one at all.
+  if (!mjpeg && ((webSocket && pumps(fd, prefix, prefixSize) < 0) ||
+      pumps(fd, mBanner, BANNER_SIZE) < 0)) {
+    close(fd);
+    return false;
+  }
+
+  gMetrics.clientsConnected.add(1);
+
+  // Viewers can't ask for frames, so they're always pushed to.
+  mClients.push_back(Client(fd, mConfig.pull && !mjpeg, webSocket));
+  mClients.back().mjpeg = mjpeg;
+
+  return true;
+}
+
+bool
+DisplayStream::passThrough(const Minicap::Frame& frame, uint64_t timestamp, bool fresh) {
+  size_t rowSize = static_cast<size_t>(frame.width) * 4;
+  size_t sourceStride = static_cast<size_t>(frame.stride) * frame.bpp;
+  bool swap = frame.format == Minicap::FORMAT_BGRA_8888;
+  // 24 and 16 bit captures are widened to RGBA on the way.
+  bool widen = (frame.format == Minicap::FORMAT_RGB_888 && frame.bpp == 3) ||
+    (frame.format == Minicap::FORMAT_RGB_565 && frame.bpp == 2);
+  bool sinks = fresh && (mRecorder != NULL || mFlightRecorder != NULL || mRtpSender != NULL);
+
+  // Not worth ending the stream over, the next capture may do.
+  if (!widen && (frame.bpp != 4 || (!swap && frame.format != Minicap::FORMAT_RGBA_8888 &&
+      frame.format != Minicap::FORMAT_RGBX_8888))) {
+    gMetrics.framesDropped.add();
+    if (mUnconvertible++ % 100 == 0) {
+      MCWARN("Unable to convert pixel format %d to RGBA, dropped %ld frames so far",
+        frame.format, mUnconvertible);
+    }
+    return true;
+  }
+
+  FrameHeader header;
+  header.format = FRAME_FORMAT_RGBA;
+  header.sequence = mSequence++;
+  header.width = frame.width;
+  header.height = frame.height;
+  header.timestamp = timestamp;
+
+  // Sinks hold on to frames after the buffer is released, and BGRA and
+  // narrower formats have to be converted anyway, so those take a tightly
+  // packed copy. Otherwise rows go out straight from the locked buffer,
+  // stride padding skipped.
+  std::shared_ptr<EncodedFrame> copy;
+
+  if (swap || widen || sinks) {
+    TraceScope trace("copy", header.sequence);
+
+    copy = mFramePool.acquire(rowSize * frame.height);
+    if (!copy) {
+      return false;
+    }
+
+    const uint8* source = static_cast<const uint8*>(frame.data);
+
+    if (swap) {
+      // Swapping R and B goes both ways.
+      ABGRToARGB(source, sourceStride, copy->data, rowSize, frame.width, frame.height);
+    }
+    else if (widen) {
+      // libyuv only widens to BGRA, so R and B are swapped after.
+      if (frame.format == Minicap::FORMAT_RGB_888) {
+        RAWToARGB(source, sourceStride, copy->data, rowSize, frame.width, frame.height);
+      }
+      else {
+        RGB565ToARGB(source, sourceStride, copy->data, rowSize, frame.width, frame.height);
+      }
+
+      ARGBToABGR(copy->data, rowSize, copy->data, rowSize, frame.width, frame.height);
+    }
+    else {
+      for (uint32_t y = 0; y < frame.height; ++y) {
+        memcpy(copy->data + y * rowSize, source + y * sourceStride, rowSize);
+      }
+    }
+
+    copy->size = rowSize * frame.height;
+    copy->header = header;
+  }
+
+  if (sinks && mRecorder != NULL) {
+    mRecorder->push(copy);
+  }
+
+  if (sinks && mFlightRecorder != NULL) {
+    mFlightRecorder->push(copy);
+  }
+
+  if (sinks && mRtpSender != NULL) {
+    mRtpSender->push(copy);
+  }
+
+  // The prefix differs between raw and WebSocket clients and is filled in
+  // per client.
+  unsigned char prefix[MAX_PREFIX_SIZE];
+  unsigned char head[FRAME_HEADER_SIZE];
+  size_t length = rowSize * frame.height;
+
+  std::vector<struct iovec> rows;
+  rows.reserve(2 + frame.height);
+  rows.push_back({prefix, 0});
+
+  if (mConfig.frameHeaders) {
+    header.serialize(head);
+    rows.push_back({head, FRAME_HEADER_SIZE});
+    length += FRAME_HEADER_SIZE;
+  }
+
+  if (copy) {
+    rows.push_back({copy->data, copy->size});
+  }
+  else if (sourceStride == rowSize) {
+    rows.push_back({const_cast<void*>(frame.data), rowSize * frame.height});
+  }
+  else {
+    const unsigned char* source = static_cast<const unsigned char*>(frame.data);
+
+    for (uint32_t y = 0; y < frame.height; ++y) {
+      rows.push_back({const_cast<unsigned char*>(source + y * sourceStride), rowSize});
+    }
+  }
+
+  std::vector<struct iovec> iov;
+  uint64_t worst = 0;
+  bool sampled = false;
+
+  for (auto& client: mClients) {
+    if (client.fd < 0 || client.skip) {
+      continue;
+    }
+
+    client.requested = false;
+
+    TraceScope trace("send", header.sequence);
+    StageTimer timer(gMetrics.sendTime);
+
+    // pumpv() eats through the vectors.
+    size_t prefixSize = put_prefix(prefix, length, client.webSocket);
+    iov = rows;
+    iov[0].iov_len = prefixSize;
+    if (pumpv(client.fd, iov.data(), iov.size()) < 0) {
+      closeClient(client);
+      continue;
+    }
+
+    timer.stop();
+    gMetrics.framesSent.add();
+    gMetrics.bytesSent.add(prefixSize + length);
+    gMetrics.frameLatency.observe(monotonicTimestamp() - timestamp);
+
+    if (mConfig.targetLatency > 0) {
+      RateController::sent(client.link, prefixSize + length);
+      worst = std::max(worst, mRate.sample(client.link, client.fd));
+      sampled = true;
+    }
+  }
+
+  // Only frame rate to give.
+  if (sampled) {
+    mRate.update(worst, false, false);
+  }
+
+  return true;
+}
+
+bool
+DisplayStream::keepWarm(Minicap::Frame& frame, bool& haveFrame) {
+  uint64_t now = monotonicTimestamp();
+
+  if (mIdleSince == 0) {
+    MCINFO("No clients on port %d, idling", mConfig.port);
+    mIdleSince = now;
+  }
+
+  if (!mAttached) {
+    return true;
+  }
+
+  // Tearing the virtual display down stops composition for it, too.
+  if (mConfig.detachAfter >= 0 &&
+      mMinicap->getCaptureMethod() == Minicap::METHOD_VIRTUAL_DISPLAY &&
+      now - mIdleSince >= static_cast<uint64_t>(mConfig.detachAfter) * 1000000) {
+    if (haveFrame) {
+      mMinicap->releaseConsumedFrame(&frame);
+      haveFrame = false;
+    }
+
+    mMinicap->release();
+    mWaiter.tryWaitForFrames();
+    mAttached = false;
+
+    MCINFO("Detached display %d", mConfig.displayId);
+    return true;
+  }
+
+  // Dumb backends capture once more and then wait for us, so there's
+  // nothing to keep up with. Their capture will be old by the time
+  // somebody shows up though.
+  if (mQuirks & QUIRK_DUMB) {
+    if (haveFrame) {
+      mMinicap->releaseConsumedFrame(&frame);
+      haveFrame = false;
+    }
+
+    mStale = true;
+    return true;
+  }
+
+  int pending = mWaiter.tryWaitForFrames();
+  if (pending == 0) {
+    return true;
+  }
+
+  // Swap whatever we had for the newest one, unconverted.
+  if (haveFrame) {
+    mMinicap->releaseConsumedFrame(&frame);
+    haveFrame = false;
+  }
+
+  int skipped;
+  int err = mMinicap->consumeLatestFrame(&frame, pending, &skipped);
+  gMetrics.framesSkipped.add(skipped);
+
+  if (err == -EINTR) {
+    return true;
+  }
+
+  if (err != 0) {
+    MCERROR("Unable to consume pending frame");
+    return false;
+  }
+
+  haveFrame = true;
+  return true;
+}
+
+bool
+DisplayStream::attach() {
+  if (mMinicap->applyConfigChanges() != 0) {
+    MCERROR("Unable to reattach display %d", mConfig.displayId);
+    return false;
+  }
+
+  mAttached = true;
+
+  MCINFO("Reattached display %d", mConfig.displayId);
+  return true;
+}
+
+void
+DisplayStream::waitForCommands(int timeout) {
+  std::vector<struct pollfd> pfds;
+
+  for (auto& client: mClients) {
+    if (client.fd >= 0 && client.commandsOpen) {
+      struct pollfd pfd;
+      pfd.fd = client.fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      pfds.push_back(pfd);
+    }
+  }
+
+  if (pfds.empty()) {
+    usleep(timeout * 1000);
+    return;
+  }
+
+  poll(pfds.data(), pfds.size(), timeout);
+}
+
+bool
+DisplayStream::sendReplays() {
+  bool more = false;
+
+  for (auto& client: mClients) {
+    size_t sent = 0;
+
+    while (client.fd >= 0 && !client.replay.empty() &&
+        sent < REPLAY_BYTES_PER_PASS && writable(client.fd)) {
+      // Replayed frames always carry a header so that the client can tell
+      // them apart from live ones.
+      EncodedFrame replay = *client.replay.front();
+      replay.header.type = FRAME_TYPE_REPLAY;
+      client.replay.pop_front();
+
+      int wrote = send_frame(client.fd, replay, true, client.webSocket);
+      if (wrote < 0) {
+        closeClient(client);
+        break;
+      }
+
+      sent += wrote;
+    }
+
+    if (client.fd < 0) {
+      client.replay.clear();
+    }
+
+    more = more || !client.replay.empty();
+  }
+
+  return more;
+}
+
+void
+DisplayStream::readCommands() {
+  for (auto& client: mClients) {
+    if (client.fd >= 0 && client.commandsOpen) {
+      client.commandsOpen = client.commands.readAvailable();
+
+      CommandReader::Command command;
+      while (client.commands.nextCommand(command)) {
+        handleCommand(command, client);
+      }
+    }
+  }
+}
+
+void
+DisplayStream::closeClient(Client& client) {
+  if (client.fd >= 0) {
+    MCINFO("Closing client connection on port %d", mConfig.port);
+    gMetrics.clientsConnected.add(-1);
+    close(client.fd);
+    client.fd = -1;
+  }
+}
+
+bool
+DisplayStream::run() {
+  Minicap::Frame frame;
+  bool haveFrame = false;
+  bool sinks = mRecorder != NULL || mFlightRecorder != NULL || mRtpSender != NULL;
+  bool ok = false;
+  std::vector<std::shared_ptr<EncodedFrame>> renditions;
+  std::vector<std::shared_ptr<EncodedFrame>> compressed;
+
+  ThreadPolicy::apply(ThreadPolicy::ROLE_STREAM);
+
+  while (!FrameWaiter::isStopped()) {
+    // Without clients or sinks there's nothing to do until somebody
+    // shows up. Don't block for good though, other displays may stop us.
+    bool idle = mClients.empty() && !sinks;
+    // Keep the newest frame locked for pull clients, so that a request
+    // can be served right away even if the screen doesn't change. Dumb
+    // backends only capture the next frame once the last one is released,
+    // so there's no point.
+    bool hold = false;
+    // Connections still being told apart are checked on often.
+    int acceptTimeout = !idle ? 0 : mPending.empty() ? IDLE_POLL_MS : PENDING_POLL_MS;
+
+    if (!acceptClient(acceptTimeout) && idle) {
+      if (!keepWarm(frame, haveFrame)) {
+        goto disaster;
+      }
+      continue;
+    }
+
+    // Resuming. A frame kept while idle goes out right away.
+    mIdleSince = 0;
+
+    if (!mAttached && !attach()) {
+      goto disaster;
+    }
+
+    if (mRecapture && !recapture(frame, haveFrame)) {
+      goto disaster;
+    }
+
+    if (mStale) {
+      int pending = mWaiter.tryWaitForFrames();
+
+      if (pending > 0 && mMinicap->consumeLatestFrame(&frame, pending) == 0) {
+        mMinicap->releaseConsumedFrame(&frame);
+      }
+
+      mStale = false;
+    }
+
+    bool replaying = sendReplays();
+
+    int pending, err;
+    if (haveFrame) {
+      // Trade the held frame for a newer one if there is one, otherwise
+      // see if anybody wants it.
+      if ((pending = mWaiter.tryWaitForFrames()) > 0) {
+        mMinicap->releaseConsumedFrame(&frame);
+        haveFrame = false;
+      }
+    }
+    else if ((pending = mWaiter.waitForFrames(replaying ? REPLAY_POLL_MS :
+        !mPending.empty() ? PENDING_POLL_MS : FRAME_POLL_MS)) == 0) {
+      // Nothing new on screen, but clients still get their commands
+      // handled.
+      readCommands();
+      goto next;
+    }
+
+    if (pending > 0) {
+      TraceScope trace("consume", mSequence);
+      int skipped;
+      err = mMinicap->consumeLatestFrame(&frame, pending, &skipped);
+      gMetrics.framesSkipped.add(skipped);
+      trace.end();
+
+      if (err != 0) {
+        if (err == -EINTR) {
+          MCINFO("Frame consumption interrupted by EINTR");
+          for (auto& client: mClients) {
+            closeClient(client);
+          }
+          goto next;
+        }
+        else {
+          MCERROR("Unable to consume pending frame");
+          goto disaster;
+        }
+      }
+
+      haveFrame = true;
+    }
+
+    if (!mEncoder.fitFrame(frame.width, frame.height)) {
+      MCERROR("Unable to reserve data for %dx%d frames", frame.width, frame.height);
+      goto disaster;
+    }
+
+    {
+      uint64_t timestamp = monotonicTimestamp();
+      // Otherwise this is the held frame again, which only pull clients
+      // asking for it get.
+      bool fresh = pending > 0;
+
+      // Apply runtime commands between frames so that the encoder never
+      // changes under a conversion.
+      unsigned int lastRendition = 0;
+      bool wantFrame = sinks && fresh;
+
+      readCommands();
+
+      for (auto& client: mClients) {
+        if (client.fd < 0) {
+          continue;
+        }
+
+        hold = hold || client.pull;
+
+        // Congested links sit this frame out, which is what brings their
+        // frame rate down. Browsers can't ask for frames, so a WebSocket or
+        // MJPEG viewer whose buffer is full counts as congested too. Viewers
+        // are left out of rate control, they only ever drop frames.
+        bool congested = client.mjpeg ? !writable(client.fd) :
+          (mConfig.targetLatency > 0 && mRate.congested(client.link, client.fd)) ||
+          (client.webSocket && !writable(client.fd));
+        if (congested) {
+          gMetrics.framesThrottled.add();
+        }
+
+        client.skip = congested || !(client.requested || (!client.pull && fresh));
+
+        if (client.skip) {
+          // Missed a picture, so the previous one is no longer what the
+          // client has.
+          if (fresh) {
+            client.synced = false;
+          }
+          continue;
+        }
+
+        wantFrame = true;
+        lastRendition = std::max(lastRendition, client.rendition);
+      }
+
+      hold = hold && !(mQuirks & QUIRK_DUMB);
+
+      if (!wantFrame) {
+        goto next;
+      }
+
+      if (mRate.getScale() != mDownscale) {
+        if (!mEncoder.setDownscale(mRate.getScale())) {
+          MCERROR("Unable to downscale to %.2f", mRate.getScale());
+          goto disaster;
+        }
+
+        mDownscale = mRate.getScale();
+      }
+
+      // Released by next as soon as it's out, unless held for pull
+      // clients.
+      if (mConfig.format == FRAME_FORMAT_RGBA) {
+        if (!passThrough(frame, timestamp, fresh)) {
+          goto disaster;
+        }
+
+        goto next;
+      }
+
+      // JPEG is compressed from raw I420, everything else is sent raw.
+      bool jpeg = mConfig.format == FRAME_FORMAT_JPG;
+
+      // Encode straight into a pooled buffer so that the recorder can hold
+      // on to it after we've moved on.
+      std::shared_ptr<EncodedFrame> encoded = mFramePool.acquire(mEncoder.getEncodedSize());
+      if (!encoded) {
+        goto disaster;
+      }
+
+      encoded->size = mEncoder.getEncodedSize();
+      encoded->header.format = jpeg ? static_cast<uint8_t>(FRAME_FORMAT_I420) : mConfig.format;
+      encoded->header.sequence = mSequence++;
+      encoded->header.x = mEncoder.crop.x;
+      encoded->header.y = mEncoder.crop.y;
+      encoded->header.width = mEncoder.nvFrame.width;
+      encoded->header.height = mEncoder.nvFrame.height;
+      encoded->header.timestamp = timestamp;
+
+      // Full size clients get their rows as soon as they're converted.
+      bool streaming = false;
+
+      if (mConfig.stripRows > 0 && !jpeg) {
+        for (auto& client: mClients) {
+          streaming = streaming ||
+            (client.fd >= 0 && !client.skip && !client.mjpeg && client.rendition == 0);
+        }
+      }
+
+      FrameHeader stripHeader = encoded->header;
+      stripHeader.type = FRAME_TYPE_STRIP;
+
+      YUVEncoder::BandListener sendStrip = [&](uint32_t first, uint32_t rows) {
+        for (auto& client: mClients) {
+          if (client.fd < 0 || client.skip || client.mjpeg || client.rendition != 0) {
+            continue;
+          }
+
+          TraceScope trace("sendStrip", stripHeader.sequence);
+          int sent = send_strip(client.fd, stripHeader, encoded->data, first, rows,
+            client.webSocket);
+          if (sent < 0) {
+            closeClient(client);
+            continue;
+          }
+
+          RateController::sent(client.link, sent);
+
+          if (first + rows == stripHeader.height) {
+            gMetrics.frameLatency.observe(monotonicTimestamp() - timestamp);
+          }
+        }
+
+        return true;
+      };
+
+      StageTimer convertTimer(gMetrics.convertTime);
+      TraceScope convertTrace("convert", encoded->header.sequence);
+
+      if (!mEncoder.encode(&frame, encoded->data, streaming ? mConfig.stripRows : 0,
+          streaming ? sendStrip : YUVEncoder::BandListener())) {
+        MCERROR("Unable to encode frame");
+        goto disaster;
+      }
+
+      renditions.assign(1, encoded);
+
+      if (lastRendition > 0 &&
+          !mSimulcast.encode(mEncoder.getI420Output(), lastRendition, mFramePool, renditions)) {
+        MCERROR("Unable to encode renditions");
+        goto disaster;
+      }
+
+      convertTimer.stop();
+      convertTrace.end();
+      gMetrics.framesConverted.add();
+
+      // This will call onFrameAvailable() on older devices, so we have
+      // to do it here or the loop will stop.
+      if (!hold) {
+        TraceScope trace("release", encoded->header.sequence);
+        mMinicap->releaseConsumedFrame(&frame);
+        haveFrame = false;
+      }
+
+      std::vector<bool> wanted(renditions.size(), false);
+      wanted[0] = sinks && fresh;
+      bool viewers = false;
+
+      for (auto& client: mClients) {
+        if (client.fd < 0 || client.skip) {
+          continue;
+        }
+
+        // MJPEG viewers only need the stream itself if it's JPEG.
+        if (client.mjpeg) {
+          viewers = true;
+          wanted[0] = wanted[0] || jpeg;
+        }
+        else {
+          wanted[client.rendition] = true;
+        }
+      }
+
+      // Only renditions somebody actually gets are compressed. Sinks
+      // record what clients would see.
+      if (jpeg) {
+        for (size_t i = 0; i < renditions.size(); ++i) {
+          if (!wanted[i]) {
+            continue;
+          }
+
+          TraceScope trace("jpeg", encoded->header.sequence);
+          YuvFrame planes = i == 0 ? mEncoder.getI420Output() : i420_view(*renditions[i]);
+          std::shared_ptr<EncodedFrame> jpg = mFramePool.acquire(
+            JpgEncoder::getMaxSize(planes.width, planes.height));
+          unsigned long size;
+
+          if (!jpg || !mJpg.encode(planes, mRate.getQuality(), jpg->data, &size)) {
+            MCERROR("Unable to compress JPEG");
+            goto disaster;
+          }
+
+          jpg->size = size;
+          jpg->header = renditions[i]->header;
+          jpg->header.format = FRAME_FORMAT_JPG;
+          renditions[i] = jpg;
+        }
+
+        encoded = renditions[0];
+      }
+
+      // All MJPEG viewers share one full size JPEG, which is the stream
+      // itself if that's JPEG already.
+      std::shared_ptr<EncodedFrame> mjpegFrame;
+
+      if (viewers && jpeg) {
+        mjpegFrame = renditions[0];
+      }
+      else if (viewers) {
+        TraceScope trace("jpeg", encoded->header.sequence);
+        YuvFrame planes = mEncoder.getI420Output();
+        mjpegFrame = mFramePool.acquire(JpgEncoder::getMaxSize(planes.width, planes.height));
+        unsigned long size;
+
+        if (!mjpegFrame || !mJpg.encode(planes, mRate.getQuality(), mjpegFrame->data, &size)) {
+          MCERROR("Unable to compress JPEG");
+          goto disaster;
+        }
+
+        mjpegFrame->size = size;
+        mjpegFrame->header = encoded->header;
+        mjpegFrame->header.format = FRAME_FORMAT_JPG;
+      }
+
+      // Clients that saw the previous picture may get a scroll instead.
+      std::shared_ptr<EncodedFrame> shifted;
+
+      if (mConfig.detectScroll && !jpeg) {
+        TraceScope trace("scroll", encoded->header.sequence);
+        shifted = mScrollDetector.encode(encoded, mFramePool);
+      }
+
+      if (shifted && mConfig.compress &&
+          !(shifted = mCompressor.compress(*shifted, mFramePool))) {
+        MCERROR("Unable to compress frame");
+        goto disaster;
+      }
+
+      if (mConfig.compress && !jpeg) {
+        TraceScope trace("compress", encoded->header.sequence);
+        compressed.assign(renditions.size(), std::shared_ptr<EncodedFrame>());
+
+        for (size_t i = 0; i < renditions.size(); ++i) {
+          if (wanted[i] && !(compressed[i] = mCompressor.compress(*renditions[i], mFramePool))) {
+            MCERROR("Unable to compress frame");
+            goto disaster;
+          }
+        }
+
+        renditions.swap(compressed);
+        compressed.clear();
+
+        if (wanted[0]) {
+          encoded = renditions[0];
+        }
+      }
+
+      if (mRecorder != NULL && fresh) {
+        mRecorder->push(encoded);
+      }
+
+      if (mFlightRecorder != NULL && fresh) {
+        mFlightRecorder->push(encoded);
+      }
+
+      if (mRtpSender != NULL && fresh) {
+        mRtpSender->push(encoded);
+      }
+
+      // Push it out synchronously because it's fast.
+      for (auto& client: mClients) {
+        if (client.fd < 0 || client.skip) {
+          continue;
+        }
+
+        client.requested = false;
+
+        if (client.mjpeg) {
+          TraceScope trace("send", mjpegFrame->header.sequence);
+          int sent = send_part(client.fd, *mjpegFrame);
+          trace.end();
+          if (sent < 0) {
+            closeClient(client);
+            continue;
+          }
+
+          gMetrics.frameLatency.observe(monotonicTimestamp() - timestamp);
+          continue;
+        }
+
+        // Already sent as strips.
+        if (streaming && client.rendition == 0) {
+          continue;
+        }
+
+        const EncodedFrame& out = shifted && client.synced && client.rendition == 0
+          ? *shifted : *renditions[client.rendition];
+
+        TraceScope trace("send", out.header.sequence);
+        int sent = send_frame(client.fd, out, mConfig.frameHeaders, client.webSocket);
+        trace.end();
+        if (sent < 0) {
+          closeClient(client);
+          continue;
+        }
+
+        RateController::sent(client.link, sent);
+        client.synced = client.rendition == 0;
+
+        gMetrics.frameLatency.observe(monotonicTimestamp() - timestamp);
+      }
+
+      if (mConfig.targetLatency > 0) {
+        uint64_t worst = 0;
+        bool sampled = false;
+
+        for (auto& client: mClients) {
+          if (client.fd >= 0 && !client.skip && !client.mjpeg) {
+            worst = std::max(worst, mRate.sample(client.link, client.fd));
+            sampled = true;
+          }
+        }
+
+        // Without frame headers only JPEG clients notice a size change.
+        if (sampled) {
+          mRate.update(worst, jpeg, jpeg || mConfig.frameHeaders);
+        }
+      }
+    }
+
+next:
+    // Have we consumed one frame but are still holding it?
+    if (haveFrame && !hold) {
+      mMinicap->releaseConsumedFrame(&frame);
+      haveFrame = false;
+    }
+
+    // Nothing to do until a request or a newer frame comes in.
+    if (haveFrame && pending == 0) {
+      waitForCommands(PULL_POLL_MS);
+    }
+
+    for (size_t i = 0; i < mClients.size();) {
+      if (mClients[i].fd < 0) {
+        mClients.erase(mClients.begin() + i);
+      }
+      else {
+        ++i;
+      }
+    }
+  }
+
+  ok = true;
+
+disaster:
+  if (haveFrame) {
+    mMinicap->releaseConsumedFrame(&frame);
+  }
+
+  for (auto& client: mClients) {
+    closeClient(client);
+  }
+
+  mClients.clear();
+
+  for (auto& pending: mPending) {
+    close(pending.fd);
+  }
+
+  mPending.clear();
+
+  return ok;
+}
@@ -0,0 +1,284 @@
+#ifndef MINICAP_DISPLAY_STREAM_HPP
+#define MINICAP_DISPLAY_STREAM_HPP
+
+#include <stdint.h>
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "CommandReader.hpp"
+#include "FlightRecorder.hpp"
+#include "FrameCompressor.hpp"
+#include "FramePool.hpp"
+#include "FrameWaiter.hpp"
+#include "HttpRequest.hpp"
+#include "JpgEncoder.hpp"
+#include "Minicap.hpp"
+#include "Protocol.hpp"
+#include "RateController.hpp"
+#include "Recorder.hpp"
+#include "RtpSender.hpp"
+#include "ScrollDetector.hpp"
+#include "SimpleServer.hpp"
+#include "Simulcast.hpp"
+
+struct DisplayConfig {
+  int32_t displayId;
+  const char* sockname;
+  int port;
+  // FRAME_FORMAT_I420, FRAME_FORMAT_NV12, FRAME_FORMAT_JPG,
+  // FRAME_FORMAT_GRAY or FRAME_FORMAT_RGBA.
+  unsigned int format;
+  // JPEG quality, the upper bound if rate control is on.
+  unsigned int quality;
+  float scaling;
+  Crop crop;
+  Minicap::DisplayInfo realInfo;
+  Minicap::DisplayInfo desiredInfo;
+  // Capture from this framebuffer instead of the library backend.
+  const char* framebufferPath;
+  // False for full size PNG or JPG screenshots, which skip the YUV
+  // encoder and so don't want a downscaled capture.
+  bool needsYuv;
+  bool prefetch;
+  bool frameHeaders;
+  // Losslessly compress payloads before sending them out.
+  bool compress;
+  // Send scrolling as FRAME_TYPE_SHIFT frames. Needs frame headers.
+  bool detectScroll;
+  // If set, full size frames go out as FRAME_TYPE_STRIP frames of this
+  // many rows as they're converted. Needs frame headers, and doesn't mix
+  // with compression or scroll detection.
+  uint32_t stripRows;
+  // Adapt quality, size and frame rate to keep latency under this many
+  // milliseconds. 0 disables rate control.
+  unsigned int targetLatency;
+  // Clients start in pull mode, getting a frame only when they ask for one.
+  bool pull;
+  // Seconds without clients after which a virtual display is torn down,
+  // or -1 to keep it.
+  int detachAfter;
+  // Rendition scales for Simulcast, starting with 1.
+  std::vector<float> renditions;
+};
+
+// Everything needed to capture one display and stream it to clients on
+// its own port: the capture backend, its frame waiter, the encoder and the
+// server. Several streams can run side by side in one process, sharing
+// the binder thread pool and the frame pool. Any number of clients may
+// connect, each receiving the rendition it subscribed to.
+class DisplayStream {
+public:
+  DisplayStream(const DisplayConfig& config, FramePool& framePool);
+
+  ~DisplayStream();
+
+  // Why the options in config can't be streamed together, or NULL if
+  // they can. Checked on startup and for every "format" command.
+  static const char*
+  checkConfig(const DisplayConfig& config);
+
+  // Creates and configures the capture backend and the encoder.
+  bool
+  setUp();
+
+  // Starts the server and prepares the banner.
+  bool
+  listen();
+
+  // Recordings are made from this stream's frames. Not owned.
+  void
+  setRecorder(Recorder* recorder) {
+    mRecorder = recorder;
+  }
+
+  void
+  setFlightRecorder(FlightRecorder* flightRecorder) {
+    mFlightRecorder = flightRecorder;
+  }
+
+  // Frames also go out over UDP through this sender. Not owned.
+  void
+  setRtpSender(RtpSender* sender) {
+    mRtpSender = sender;
+  }
+
+  // Compression is split over this pool. Not owned.
+  void
+  setWorkerPool(WorkerPool* pool) {
+    mCompressor.setPool(pool);
+  }
+
+  // Serves clients until stopped. Returns false on a fatal error.
+  bool
+  run();
+
+  Minicap*
+  getMinicap() {
+    return mMinicap;
+  }
+
+  FrameWaiter&
+  getWaiter() {
+    return mWaiter;
+  }
+
+  YUVEncoder&
+  getEncoder() {
+    return mEncoder;
+  }
+
+  const unsigned char*
+  getBanner() {
+    return mBanner;
+  }
+
+private:
+  struct Client {
+    int fd;
+    CommandReader commands;
+    bool commandsOpen;
+    unsigned int rendition;
+    // Holds the last full size picture, so shift frames can be applied.
+    bool synced;
+    RateController::Link link;
+    // Doesn't get the current frame, because its link is congested or it
+    // hasn't asked for one.
+    bool skip;
+    // Gets frames on request ("frame") rather than all of them.
+    bool pull;
+    // Wants the current picture even if it's not new. Push clients start
+    // out that way.
+    bool requested;
+    // Upgraded to a WebSocket, so everything it gets is a message.
+    bool webSocket;
+    // An HTTP viewer of /stream.mjpeg, which gets JPEG parts and nothing else.
+    bool mjpeg;
+    // Recorded frames still to be sent after "flight send".
+    std::deque<std::shared_ptr<EncodedFrame>> replay;
+
+    Client(int fd, bool pull, bool webSocket): fd(fd), commands(fd), commandsOpen(true),
+        rendition(0), synced(false), skip(false), pull(pull), requested(!pull),
+        webSocket(webSocket), mjpeg(false) {
+      commands.setWebSocket(webSocket);
+    }
+  };
+
+  DisplayConfig mConfig;
+  FramePool& mFramePool;
+  FrameWaiter mWaiter;
+  YUVEncoder mEncoder;
+  Simulcast mSimulcast;
+  FrameCompressor mCompressor;
+  ScrollDetector mScrollDetector;
+  JpgEncoder mJpg;
+  RateController mRate;
+  float mDownscale;
+  SimpleServer mServer;
+  Minicap* mBackend;
+  Minicap* mMinicap;
+  unsigned char mQuirks;
+  unsigned char mBanner[BANNER_SIZE];
+  uint32_t mSequence;
+  // When the last client left, 0 while there are clients.
+  uint64_t mIdleSince;
+  bool mAttached;
+  // The capture waiting since we went idle is outdated.
+  bool mStale;
+  Recorder* mRecorder;
+  FlightRecorder* mFlightRecorder;
+  RtpSender* mRtpSender;
+  // Captured frames that couldn't be passed through as RGBA.
+  unsigned long mUnconvertible;
+  // What the backend was asked to capture, and what goes out of it.
+  Minicap::DisplayInfo mCaptureInfo;
+  uint32_t mOutputWidth;
+  uint32_t mOutputHeight;
+  // A crop command that needs a different capture size, applied by
+  // recapture() between frames.
+  Crop mRecrop;
+  bool mRecapture;
+
+  // A connection that hasn't shown yet whether it's a raw protocol
+  // client, a WebSocket or an MJPEG viewer.
+  struct PendingClient {
+    int fd;
+    // When to stop waiting for it, in monotonicTimestamp() microseconds.
+    uint64_t deadline;
+    // Started an HTTP request, which is being read.
+    bool http;
+    HttpRequest request;
+  };
+
+  std::vector<Client> mClients;
+  std::vector<PendingClient> mPending;
+
+  // Takes a new connection if one comes in within timeout milliseconds,
+  // and admits the pending ones that have shown what they are. Returns
+  // whether a client was admitted.
+  bool
+  acceptClient(int timeout);
+
+  // Finds out what a pending connection is without blocking. Returns 1
+  // once it's a client, 0 while it's still pending, or -1 if it was closed.
+  int
+  classifyClient(PendingClient& pending);
+
+  // Sends the banner and starts serving the client.
+  bool
+  admitClient(int fd, bool webSocket, bool mjpeg);
+
+  // Sends the captured frame as FRAME_FORMAT_RGBA, without converting it
+  // if it already is RGBA.
+  bool
+  passThrough(const Minicap::Frame& frame, uint64_t timestamp, bool fresh);
+
+  // Puts the stream format and its frame size in the banner.
+  void
+  putBannerFormat();
+
+  // Keeps the newest frame at hand while there are no clients, without
+  // converting anything, and detaches the display after a while if
+  // configured to.
+  bool
+  keepWarm(Minicap::Frame& frame, bool& haveFrame);
+
+  // Recreates a detached display.
+  bool
+  attach();
+
+  // The capture size to negotiate with the backend, with or without a crop.
+  Minicap::DisplayInfo
+  captureInfoFor(bool cropping) const;
+
+  // Switches the capture to the size the requested crop needs, and then
+  // applies the crop. Any frame still held is released first.
+  bool
+  recapture(Minicap::Frame& frame, bool& haveFrame);
+
+  // Sends the next part of pending flight recorder replays, as far as the
+  // clients' sockets take them without blocking. Returns whether there's
+  // more to send.
+  bool
+  sendReplays();
+
+  // Reads whatever clients sent and applies their commands.
+  void
+  readCommands();
+
+  // Waits until a client has something to say, or the timeout expires.
+  void
+  waitForCommands(int timeout);
+
+  void
+  closeClient(Client& client);
+
+  void
+  handleCommand(const CommandReader::Command& command, Client& client);
+
+  void
+  handleFlightCommand(const CommandReader::Command& command, Client& client);
+};
+
+#endif
@@ -0,0 +1,124 @@
+#include "FlightRecorder.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <thread>
+
+#include "util/debug.h"
+
+static int
+write_all(int fd, const unsigned char* data, size_t length) {
+  while (length > 0) {
+    ssize_t wrote = write(fd, data, length);
+
+    if (wrote < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+
+    data += wrote;
+    length -= wrote;
+  }
+
+  return 0;
+}
+
+FlightRecorder::FlightRecorder(size_t budget, unsigned int seconds,
+    const std::string& dumpDirectory)
+  : mBudget(budget),
+    mDumpDirectory(dumpDirectory),
+    mMaxAge(static_cast<uint64_t>(seconds) * 1000000),
+    mSize(0) {
+  MCINFO("Flight recorder keeping up to %ld KB or %d seconds of frames",
+    (long) (budget / 1024), seconds);
+}
+
+void
+FlightRecorder::push(const std::shared_ptr<EncodedFrame>& frame) {
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  mFrames.push_back(frame);
+  mSize += frame->size;
+
+  uint64_t now = frame->header.timestamp;
+
+  // Evict from the front until we're within budget, but always keep the
+  // newest frame.
+  while (mFrames.size() > 1 && (mSize > mBudget ||
+      now - mFrames.front()->header.timestamp > mMaxAge)) {
+    mSize -= mFrames.front()->size;
+    mFrames.pop_front();
+  }
+}
+
+void
+FlightRecorder::snapshot(std::vector<std::shared_ptr<EncodedFrame>>& frames) {
+  std::unique_lock<std::mutex> lock(mMutex);
+  frames.assign(mFrames.begin(), mFrames.end());
+}
+
+bool
+FlightRecorder::dump(const std::string& name, const unsigned char* banner, size_t bannerSize) {
+  if (mDumpDirectory.empty()) {
+    MCWARN("Flight dumps are disabled, give -m a directory");
+    return false;
+  }
+
+  if (name.empty() || name == "." || name == ".." || name.find('/') != std::string::npos) {
+    MCWARN("Invalid flight dump name '%s', need a plain file name", name.c_str());
+    return false;
+  }
+
+  std::string path = mDumpDirectory + "/" + name;
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0644);
+  if (fd < 0) {
+    MCERROR("Unable to open %s", path.c_str());
+    return false;
+  }
+
+  std::shared_ptr<std::vector<std::shared_ptr<EncodedFrame>>> frames(
+    new std::vector<std::shared_ptr<EncodedFrame>>());
+  snapshot(*frames);
+
+  // Frames in the dump always carry headers.
+  std::vector<unsigned char> head(banner, banner + bannerSize);
+  head[24] |= BANNER_FLAG_FRAME_HEADER;
+  // The frames stay alive (and out of the pool) until the thread is done.
+  std::thread([fd, frames, head, path]() {
+    bool ok = write_all(fd, &head[0], head.size()) == 0;
+
+    for (auto& frame: *frames) {
+      if (!ok) {
+        break;
+      }
+
+      unsigned char header[4 + FRAME_HEADER_SIZE];
+      putUInt32LE(header, FRAME_HEADER_SIZE + frame->size);
+      frame->header.serialize(header + 4);
+
+      ok = write_all(fd, header, sizeof(header)) == 0 &&
+        write_all(fd, frame->data, frame->size) == 0;
+    }
+
+    fsync(fd);
+    close(fd);
+
+    if (ok) {
+      MCINFO("Dumped %d frames to %s", (int) frames->size(), path.c_str());
+    }
+    else {
+      MCERROR("Unable to dump frames to %s", path.c_str());
+    }
+  }).detach();
+
+  return true;
+}
+
+size_t
+FlightRecorder::getSize() {
+  std::unique_lock<std::mutex> lock(mMutex);
+  return mSize;
+}
@@ -0,0 +1,48 @@
+#ifndef MINICAP_FLIGHT_RECORDER_HPP
+#define MINICAP_FLIGHT_RECORDER_HPP
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "FramePool.hpp"
+
+// Keeps the most recent encoded frames in memory, bounded by both a byte
+// budget and an age, so that the last moments before a failure can be
+// pulled out after the fact. Frames are held by reference; adding one
+// costs no copy. The budget counts frame sizes, so the pool buffers kept
+// alive can add up to more, e.g. JPEG buffers sized for the worst case.
+class FlightRecorder {
+public:
+  // Dumps go to dumpDirectory, or are refused if it's empty.
+  FlightRecorder(size_t budget, unsigned int seconds, const std::string& dumpDirectory);
+
+  void
+  push(const std::shared_ptr<EncodedFrame>& frame);
+
+  // Takes a consistent copy of the frame list (not the frame data).
+  void
+  snapshot(std::vector<std::shared_ptr<EncodedFrame>>& frames);
+
+  // Writes the buffered frames to a file in the dump directory, in the same
+  // format as a recording segment (banner, then length-prefixed frames with
+  // headers). The write happens on a background thread. Clients pick the
+  // name, so it can't point anywhere else.
+  bool
+  dump(const std::string& name, const unsigned char* banner, size_t bannerSize);
+
+  size_t
+  getSize();
+
+private:
+  std::mutex mMutex;
+  std::deque<std::shared_ptr<EncodedFrame>> mFrames;
+  size_t mBudget;
+  std::string mDumpDirectory;
+  uint64_t mMaxAge;
+  size_t mSize;
+};
+
+#endif
@@ -0,0 +1,234 @@
+#include "FrameCompressor.hpp"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "Metrics.hpp"
+#include "Protocol.hpp"
+#include "util/debug.h"
+
+#define CONTAINER_VERSION 1
+#define CONTAINER_HEADER_SIZE 8
+#define SEGMENT_ENTRY_SIZE 12
+
+// Rows per strip. Fewer rows than this and the per-strip bookkeeping
+// starts to show.
+#define MIN_STRIP_ROWS 32
+
+#define MAX_LITERALS 128
+#define MIN_RUN 3
+#define MAX_SHORT_RUN (0xFE - 0x80 + MIN_RUN)
+#define MAX_LONG_RUN 0xFFFF
+
+static void
+put_uint16_le(unsigned char* data, uint16_t value) {
+  data[0] = value & 0xFF;
+  data[1] = (value >> 8) & 0xFF;
+}
+
+static unsigned char*
+put_literals(unsigned char* out, const unsigned char* in, size_t length) {
+  while (length > 0) {
+    size_t chunk = std::min(length, static_cast<size_t>(MAX_LITERALS));
+    *out++ = chunk - 1;
+    memcpy(out, in, chunk);
+    out += chunk;
+    in += chunk;
+    length -= chunk;
+  }
+
+  return out;
+}
+
+static unsigned char*
+put_run(unsigned char* out, unsigned char value, size_t length) {
+  if (length <= MAX_SHORT_RUN) {
+    *out++ = 0x80 + length - MIN_RUN;
+  }
+  else {
+    *out++ = 0xFF;
+    put_uint16_le(out, length);
+    out += 2;
+  }
+
+  *out++ = value;
+  return out;
+}
+
+FrameCompressor::FrameCompressor()
+  : mPool(NULL),
+    mSegmentCount(0) {
+}
+
+void
+FrameCompressor::addPlane(const unsigned char* data, uint32_t row, uint32_t rows,
+    unsigned int strips) {
+  uint32_t rowsPerStrip = std::max(static_cast<uint32_t>(MIN_STRIP_ROWS),
+    (rows + strips - 1) / strips);
+
+  for (uint32_t first = 0; first < rows; first += rowsPerStrip) {
+    if (mSegmentCount == mSegments.size()) {
+      mSegments.resize(mSegmentCount + 1);
+    }
+
+    Segment& segment = mSegments[mSegmentCount++];
+    segment.data = data + static_cast<size_t>(first) * row;
+    segment.length = static_cast<size_t>(std::min(rowsPerStrip, rows - first)) * row;
+    segment.row = row;
+  }
+}
+
+void
+FrameCompressor::encodeSegment(Segment& segment) {
+  const unsigned char* in = segment.data;
+  size_t length = segment.length;
+  size_t row = std::min(static_cast<size_t>(segment.row), length);
+
+  segment.residuals.resize(length);
+  unsigned char* residuals = &segment.residuals[0];
+
+  // The first row predicts from the left, the rest from above. Strips are
+  // self-contained so they can be decoded in any order.
+  if (length > 0) {
+    residuals[0] = in[0];
+  }
+
+  for (size_t i = 1; i < row; ++i) {
+    residuals[i] = in[i] - in[i - 1];
+  }
+
+  for (size_t i = row; i < length; ++i) {
+    residuals[i] = in[i] - in[i - row];
+  }
+
+  // Literals never grow by more than one byte in MAX_LITERALS, and runs
+  // never grow at all.
+  segment.encoded.resize(length + length / MAX_LITERALS + 1);
+  unsigned char* out = &segment.encoded[0];
+  size_t literals = 0;
+
+  for (size_t i = 0; i < length;) {
+    size_t end = i + 1;
+    size_t limit = std::min(length, i + MAX_LONG_RUN);
+    while (end < limit && residuals[end] == residuals[i]) {
+      ++end;
+    }
+
+    if (end - i >= MIN_RUN) {
+      out = put_literals(out, residuals + literals, i - literals);
+      out = put_run(out, residuals[i], end - i);
+      literals = end;
+    }
+
+    i = end;
+  }
+
+  out = put_literals(out, residuals + literals, length - literals);
+
+  size_t encodedLength = out - &segment.encoded[0];
+
+  // Noise doesn't compress; store it as is, which also tells the decoder
+  // what happened.
+  if (encodedLength >= length) {
+    segment.encoded.assign(in, in + length);
+  }
+  else {
+    segment.encoded.resize(encodedLength);
+  }
+}
+
+std::shared_ptr<EncodedFrame>
+FrameCompressor::compress(const EncodedFrame& frame, FramePool& pool) {
+  StageTimer timer(gMetrics.compressTime);
+
+  uint32_t width = frame.header.width;
+  uint32_t height = frame.header.height;
+  size_t lumaSize = static_cast<size_t>(width) * height;
+  unsigned int strips = mPool != NULL ? mPool->size() * 2 : 1;
+
+  mSegmentCount = 0;
+
+  switch (frame.header.format) {
+  case FRAME_FORMAT_I420:
+    if (frame.size == lumaSize * 3 / 2) {
+      addPlane(frame.data, width, height, strips);
+      addPlane(frame.data + lumaSize, width / 2, height / 2, strips);
+      addPlane(frame.data + lumaSize * 5 / 4, width / 2, height / 2, strips);
+    }
+    break;
+  case FRAME_FORMAT_NV12:
+    // Interleaved chroma still lines up vertically.
+    if (frame.size == lumaSize * 3 / 2) {
+      addPlane(frame.data, width, height, strips);
+      addPlane(frame.data + lumaSize, width, height / 2, strips);
+    }
+    break;
+  case FRAME_FORMAT_GRAY:
+    if (frame.size == lumaSize) {
+      addPlane(frame.data, width, height, strips);
+    }
+    break;
+  }
+
+  // Anything unexpected still goes through, just without the strips.
+  if (mSegmentCount == 0 && frame.size > 0) {
+    addPlane(frame.data, frame.size, 1, 1);
+  }
+
+  if (mSegmentCount > 0xFFFF) {
+    MCERROR("Too many segments to compress (%d)", (int) mSegmentCount);
+    return std::shared_ptr<EncodedFrame>();
+  }
+
+  if (mPool != NULL) {
+    mPool->parallelFor(mSegmentCount, [this](unsigned int i) {
+      encodeSegment(mSegments[i]);
+    });
+  }
+  else {
+    for (size_t i = 0; i < mSegmentCount; ++i) {
+      encodeSegment(mSegments[i]);
+    }
+  }
+
+  size_t size = CONTAINER_HEADER_SIZE + mSegmentCount * SEGMENT_ENTRY_SIZE;
+  for (size_t i = 0; i < mSegmentCount; ++i) {
+    size += mSegments[i].encoded.size();
+  }
+
+  std::shared_ptr<EncodedFrame> compressed = pool.acquire(size);
+  if (!compressed) {
+    return compressed;
+  }
+
+  unsigned char* out = compressed->data;
+  out[0] = CONTAINER_VERSION;
+  out[1] = 0;
+  put_uint16_le(out + 2, mSegmentCount);
+  putUInt32LE(out + 4, frame.size);
+  out += CONTAINER_HEADER_SIZE;
+
+  for (size_t i = 0; i < mSegmentCount; ++i) {
+    putUInt32LE(out, mSegments[i].length);
+    putUInt32LE(out + 4, mSegments[i].row);
+    putUInt32LE(out + 8, mSegments[i].encoded.size());
+    out += SEGMENT_ENTRY_SIZE;
+  }
+
+  for (size_t i = 0; i < mSegmentCount; ++i) {
+    const Segment& segment = mSegments[i];
+    if (!segment.encoded.empty()) {
+      memcpy(out, &segment.encoded[0], segment.encoded.size());
+      out += segment.encoded.size();
+    }
+  }
+
+  compressed->size = size;
+  compressed->header = frame.header;
+
+  timer.stop();
+  gMetrics.bytesCompressed.add(frame.size);
+
+  return compressed;
+}
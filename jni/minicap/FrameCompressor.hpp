@@ -0,0 +1,76 @@
+#ifndef MINICAP_FRAME_COMPRESSOR_HPP
+#define MINICAP_FRAME_COMPRESSOR_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include "FramePool.hpp"
+#include "WorkerPool.hpp"
+
+// Lossless compression for raw YUV payloads (-c). UI content is mostly
+// flat, so each plane is run through a vertical delta predictor and the
+// residuals, largely zero, are run length encoded. Planes are cut into
+// strips of rows that are compressed independently on the worker pool.
+//
+// The container, all little endian:
+//
+//   0  u8   version (1)
+//   1  u8   reserved
+//   2  u16  segment count
+//   4  u32  decoded size
+//   8       per segment: u32 decoded length, u32 row length, u32 encoded
+//           length
+//   ...     encoded segments, back to back
+//
+// Decoded segments concatenate to the original payload. A segment whose
+// encoded length equals its decoded length is stored verbatim. Otherwise
+// it is a series of tokens:
+//
+//   0x00-0x7F  n + 1 literal residuals follow
+//   0x80-0xFE  the next byte repeats n - 0x80 + 3 times
+//   0xFF       u16 count, then the byte repeating count times
+//
+// Each residual is the byte minus the one a row length above it, or the
+// one to its left on the first row of the segment (0 for the first byte),
+// modulo 256. See example/mcz.js for a decoder.
+class FrameCompressor {
+public:
+  FrameCompressor();
+
+  // Strips are compressed on this pool if set. Not owned.
+  void
+  setPool(WorkerPool* pool) {
+    mPool = pool;
+  }
+
+  // Compresses a raw I420, NV12 or gray frame into a new pooled frame with
+  // the same header.
+  std::shared_ptr<EncodedFrame>
+  compress(const EncodedFrame& frame, FramePool& pool);
+
+private:
+  struct Segment {
+    const unsigned char* data;
+    size_t length;
+    uint32_t row;
+    std::vector<unsigned char> residuals;
+    std::vector<unsigned char> encoded;
+  };
+
+  WorkerPool* mPool;
+  // Kept across frames so that the scratch buffers are reused.
+  std::vector<Segment> mSegments;
+  size_t mSegmentCount;
+
+  void
+  addPlane(const unsigned char* data, uint32_t row, uint32_t rows,
+    unsigned int strips);
+
+  static void
+  encodeSegment(Segment& segment);
+};
+
+#endif
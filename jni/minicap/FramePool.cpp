@@ -0,0 +1,82 @@
+#include "FramePool.hpp"
+
+#include <stdlib.h>
+
+#include "util/debug.h"
+
+FramePool::FramePool(size_t keep)
+  : mShared(new Shared()) {
+  mShared->keep = keep;
+  mShared->closed = false;
+}
+
+FramePool::~FramePool() {
+  std::unique_lock<std::mutex> lock(mShared->mutex);
+
+  // Frames still in use are freed by their last holder instead.
+  mShared->closed = true;
+
+  for (auto frame: mShared->idle) {
+    destroy(frame);
+  }
+
+  mShared->idle.clear();
+}
+
+std::shared_ptr<EncodedFrame>
+FramePool::acquire(size_t size) {
+  EncodedFrame* frame = NULL;
+
+  {
+    std::unique_lock<std::mutex> lock(mShared->mutex);
+
+    if (!mShared->idle.empty()) {
+      frame = mShared->idle.back();
+      mShared->idle.pop_back();
+    }
+  }
+
+  if (frame == NULL) {
+    frame = new EncodedFrame();
+    frame->data = NULL;
+    frame->capacity = 0;
+  }
+
+  if (frame->capacity < size) {
+    unsigned char* data = static_cast<unsigned char*>(realloc(frame->data, size));
+    if (data == NULL) {
+      MCERROR("Unable to allocate %ld bytes for an encoded frame", (long) size);
+      destroy(frame);
+      return std::shared_ptr<EncodedFrame>();
+    }
+
+    frame->data = data;
+    frame->capacity = size;
+  }
+
+  frame->size = 0;
+  frame->header = FrameHeader();
+
+  std::shared_ptr<Shared> shared = mShared;
+  return std::shared_ptr<EncodedFrame>(frame, [shared](EncodedFrame* frame) {
+    recycle(shared, frame);
+  });
+}
+
+void
+FramePool::recycle(std::shared_ptr<Shared> shared, EncodedFrame* frame) {
+  std::unique_lock<std::mutex> lock(shared->mutex);
+
+  if (shared->closed || shared->idle.size() >= shared->keep) {
+    destroy(frame);
+    return;
+  }
+
+  shared->idle.push_back(frame);
+}
+
+void
+FramePool::destroy(EncodedFrame* frame) {
+  free(frame->data);
+  delete frame;
+}
@@ -0,0 +1,51 @@
+#ifndef MINICAP_FRAME_POOL_HPP
+#define MINICAP_FRAME_POOL_HPP
+
+#include <stddef.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "Protocol.hpp"
+
+// An encoded frame ready to go out, along with the header describing it.
+struct EncodedFrame {
+  unsigned char* data;
+  size_t capacity;
+  size_t size;
+  FrameHeader header;
+};
+
+// Recycles encoded frame buffers. Frames are handed out as shared pointers
+// and return to the pool once the last holder lets go, so slow consumers
+// on other threads (recorders, ring buffers) can keep a frame without it
+// being copied and without the encoder overwriting it.
+class FramePool {
+public:
+  // At most `keep` idle buffers are retained.
+  FramePool(size_t keep = 8);
+
+  ~FramePool();
+
+  std::shared_ptr<EncodedFrame>
+  acquire(size_t size);
+
+private:
+  struct Shared {
+    std::mutex mutex;
+    std::vector<EncodedFrame*> idle;
+    size_t keep;
+    bool closed;
+  };
+
+  std::shared_ptr<Shared> mShared;
+
+  static void
+  recycle(std::shared_ptr<Shared> shared, EncodedFrame* frame);
+
+  static void
+  destroy(EncodedFrame* frame);
+};
+
+#endif
@@ -0,0 +1,3 @@
+#include "FrameWaiter.hpp"
+
+std::atomic<bool> FrameWaiter::sStopped(false);
@@ -0,0 +1,112 @@
+#ifndef MINICAP_FRAME_WAITER_HPP
+#define MINICAP_FRAME_WAITER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+#include "Minicap.hpp"
+#include "Metrics.hpp"
+#include "ThreadPolicy.hpp"
+#include "Tracer.hpp"
+
+// Counts the frames a capture backend reports as available. Stopping is
+// process wide: stopAll() is meant for the signal handler and wakes up
+// every waiter of every display.
+class FrameWaiter: public Minicap::FrameAvailableListener {
+public:
+  FrameWaiter()
+    : mPendingFrames(0),
+      mTimeout(std::chrono::milliseconds(100)) {
+  }
+
+  int
+  waitForFrame() {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    while (!isStopped()) {
+      if (mCondition.wait_for(lock, mTimeout, [this]{return mPendingFrames > 0;})) {
+        return mPendingFrames--;
+      }
+    }
+
+    return 0;
+  }
+
+  // Like waitForFrame(), but claims every pending frame at once and
+  // returns how many there were, for Minicap::consumeLatestFrame().
+  int
+  waitForFrames() {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    while (!isStopped()) {
+      if (mCondition.wait_for(lock, mTimeout, [this]{return mPendingFrames > 0;})) {
+        return takePendingFrames();
+      }
+    }
+
+    return 0;
+  }
+
+  // Like waitForFrames(), but gives up after timeout milliseconds and
+  // returns 0, so that the caller gets to serve its clients meanwhile.
+  int
+  waitForFrames(int timeout) {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    if (timeout > 0) {
+      mCondition.wait_for(lock, std::chrono::milliseconds(timeout),
+        [this]{return mPendingFrames > 0 || isStopped();});
+    }
+
+    return takePendingFrames();
+  }
+
+  // Like waitForFrames(), but returns 0 right away if nothing is pending.
+  int
+  tryWaitForFrames() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    return takePendingFrames();
+  }
+
+  void
+  onFrameAvailable() {
+    // Usually a binder thread, which we don't get to start ourselves.
+    ThreadPolicy::applyOnce(ThreadPolicy::ROLE_CAPTURE);
+
+    gMetrics.framesCaptured.add();
+    gTracer.instant("frameAvailable", 0);
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    mPendingFrames += 1;
+    mCondition.notify_one();
+  }
+
+  static void
+  stopAll() {
+    sStopped = true;
+  }
+
+  static bool
+  isStopped() {
+    return sStopped;
+  }
+
+private:
+  static std::atomic<bool> sStopped;
+
+  std::mutex mMutex;
+  std::condition_variable mCondition;
+  int mPendingFrames;
+  std::chrono::milliseconds mTimeout;
+
+  int
+  takePendingFrames() {
+    int pending = mPendingFrames;
+    mPendingFrames = 0;
+    return pending;
+  }
+};
+
+#endif
@@ -0,0 +1,278 @@
+#include "FramebufferMinicap.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fb.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <thread>
+
+#include "util/debug.h"
+
+#ifndef FBIO_WAITFORVSYNC
+#define FBIO_WAITFORVSYNC _IOW('F', 0x20, uint32_t)
+#endif
+
+// Frame interval when there's no vsync to wait for.
+#define FALLBACK_FRAME_INTERVAL_US 16667
+
+static Minicap::Format
+convert_format(const fb_var_screeninfo& vinfo) {
+  switch (vinfo.bits_per_pixel) {
+  case 32:
+    if (vinfo.red.offset == 0) {
+      return vinfo.transp.length > 0
+        ? Minicap::FORMAT_RGBA_8888
+        : Minicap::FORMAT_RGBX_8888;
+    }
+    if (vinfo.red.offset == 16) {
+      return Minicap::FORMAT_BGRA_8888;
+    }
+    return Minicap::FORMAT_UNKNOWN;
+  // Only the byte orders the encoder can convert from.
+  case 24:
+    return vinfo.red.offset == 0
+      ? Minicap::FORMAT_RGB_888
+      : Minicap::FORMAT_UNKNOWN;
+  case 16:
+    return vinfo.red.offset == 11
+      ? Minicap::FORMAT_RGB_565
+      : Minicap::FORMAT_UNKNOWN;
+  default:
+    return Minicap::FORMAT_UNKNOWN;
+  }
+}
+
+FramebufferMinicap::FramebufferMinicap(const std::string& path, int32_t displayId)
+  : mPath(path),
+    mDisplayId(displayId),
+    mListener(NULL),
+    mFd(-1),
+    mMapping(NULL),
+    mMappingSize(0),
+    mDevice(false),
+    mVsync(false),
+    mWidth(0),
+    mHeight(0),
+    mVirtualHeight(0),
+    mLineLength(0),
+    mBpp(0),
+    mFormat(FORMAT_UNKNOWN) {
+  memset(&mRealInfo, 0, sizeof(mRealInfo));
+}
+
+FramebufferMinicap::~FramebufferMinicap() {
+  release();
+}
+
+int
+FramebufferMinicap::readGeometry() {
+  fb_var_screeninfo vinfo;
+  fb_fix_screeninfo finfo;
+
+  if (ioctl(mFd, FBIOGET_VSCREENINFO, &vinfo) == 0 &&
+      ioctl(mFd, FBIOGET_FSCREENINFO, &finfo) == 0) {
+    mDevice = true;
+    mWidth = vinfo.xres;
+    mHeight = vinfo.yres;
+    mVirtualHeight = vinfo.yres_virtual;
+    mBpp = vinfo.bits_per_pixel / 8;
+    mLineLength = finfo.line_length;
+    mFormat = convert_format(vinfo);
+    mMappingSize = finfo.smem_len;
+
+    if (mFormat == FORMAT_UNKNOWN) {
+      MCERROR("Unsupported framebuffer format (%d bpp, red at %d)",
+        vinfo.bits_per_pixel, vinfo.red.offset);
+      return -EINVAL;
+    }
+
+    return 0;
+  }
+
+  if (errno != ENOTTY && errno != EINVAL) {
+    MCERROR("Unable to query framebuffer %s: %s", mPath.c_str(), strerror(errno));
+    return -errno;
+  }
+
+  // Not a device, so treat it as a single raw RGBA page.
+  if (mRealInfo.width == 0 || mRealInfo.height == 0) {
+    MCERROR("%s is not a framebuffer device and real display size is unknown",
+      mPath.c_str());
+    return -EINVAL;
+  }
+
+  struct stat st;
+  if (fstat(mFd, &st) < 0) {
+    return -errno;
+  }
+
+  mDevice = false;
+  mWidth = mRealInfo.width;
+  mHeight = mRealInfo.height;
+  mVirtualHeight = mHeight;
+  mBpp = 4;
+  mLineLength = mWidth * mBpp;
+  mFormat = FORMAT_RGBA_8888;
+  mMappingSize = st.st_size;
+
+  return 0;
+}
+
+int
+FramebufferMinicap::applyConfigChanges() {
+  int err;
+
+  release();
+
+  if ((mFd = open(mPath.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
+    MCERROR("Unable to open %s: %s", mPath.c_str(), strerror(errno));
+    return -errno;
+  }
+
+  if ((err = readGeometry()) != 0) {
+    release();
+    return err;
+  }
+
+  if (mMappingSize < static_cast<size_t>(mLineLength) * mHeight ||
+      mLineLength % mBpp != 0) {
+    MCERROR("Framebuffer %s is too small for %dx%d", mPath.c_str(), mWidth, mHeight);
+    release();
+    return -EINVAL;
+  }
+
+  void* mapping = mmap(NULL, mMappingSize, PROT_READ, MAP_SHARED, mFd, 0);
+  if (mapping == MAP_FAILED) {
+    MCERROR("Unable to map %s: %s", mPath.c_str(), strerror(errno));
+    release();
+    return -errno;
+  }
+
+  mMapping = static_cast<unsigned char*>(mapping);
+
+  uint32_t crtc = 0;
+  mVsync = mDevice && ioctl(mFd, FBIO_WAITFORVSYNC, &crtc) == 0;
+
+  MCINFO("Mapped %s: %dx%d, %d bytes per line, %d page(s)%s",
+    mPath.c_str(), mWidth, mHeight, mLineLength, mVirtualHeight / mHeight,
+    mVsync ? ", vsync" : "");
+
+  mNextFrame = std::chrono::steady_clock::now();
+
+  // Like the screenshot method, there's always a frame to be had.
+  mListener->onFrameAvailable();
+
+  return 0;
+}
+
+int
+FramebufferMinicap::activeOffset(size_t* offset) {
+  uint32_t yoffset = 0;
+  uint32_t xoffset = 0;
+
+  if (mDevice) {
+    // The panning offset moves on every flip, so it has to be queried for
+    // each frame. It's a cheap ioctl.
+    fb_var_screeninfo vinfo;
+    if (ioctl(mFd, FBIOGET_VSCREENINFO, &vinfo) < 0) {
+      return -errno;
+    }
+
+    yoffset = vinfo.yoffset;
+    xoffset = vinfo.xoffset;
+  }
+
+  *offset = static_cast<size_t>(yoffset) * mLineLength + xoffset * mBpp;
+
+  if (*offset + static_cast<size_t>(mLineLength) * mHeight > mMappingSize) {
+    MCERROR("Framebuffer page at %d,%d is out of bounds", xoffset, yoffset);
+    return -EINVAL;
+  }
+
+  return 0;
+}
+
+int
+FramebufferMinicap::consumePendingFrame(Frame* frame) {
+  if (mMapping == NULL) {
+    return -EINVAL;
+  }
+
+  // Pace ourselves to the display, or at least don't spin.
+  uint32_t crtc = 0;
+  if (!mVsync || ioctl(mFd, FBIO_WAITFORVSYNC, &crtc) < 0) {
+    mNextFrame += std::chrono::microseconds(FALLBACK_FRAME_INTERVAL_US);
+    std::this_thread::sleep_until(mNextFrame);
+  }
+
+  size_t offset;
+  int err;
+  if ((err = activeOffset(&offset)) != 0) {
+    return err;
+  }
+
+  frame->data = mMapping + offset;
+  frame->format = mFormat;
+  frame->width = mWidth;
+  frame->height = mHeight;
+  frame->stride = mLineLength / mBpp;
+  frame->bpp = mBpp;
+  frame->size = static_cast<size_t>(mLineLength) * mHeight;
+
+  return 0;
+}
+
+Minicap::CaptureMethod
+FramebufferMinicap::getCaptureMethod() {
+  return METHOD_FRAMEBUFFER;
+}
+
+int32_t
+FramebufferMinicap::getDisplayId() {
+  return mDisplayId;
+}
+
+void
+FramebufferMinicap::release() {
+  if (mMapping != NULL) {
+    munmap(mMapping, mMappingSize);
+    mMapping = NULL;
+  }
+
+  if (mFd >= 0) {
+    close(mFd);
+    mFd = -1;
+  }
+}
+
+void
+FramebufferMinicap::releaseConsumedFrame(Frame* /* frame */) {
+  mListener->onFrameAvailable();
+}
+
+int
+FramebufferMinicap::setDesiredInfo(const DisplayInfo& /* info */) {
+  // There's no scaling or rotation here, the encoder does that.
+  return 0;
+}
+
+void
+FramebufferMinicap::setFrameAvailableListener(FrameAvailableListener* listener) {
+  mListener = listener;
+}
+
+int
+FramebufferMinicap::setRealInfo(const DisplayInfo& info) {
+  mRealInfo = info;
+  return 0;
+}
+
+bool
+FramebufferMinicap::isTearFree() {
+  return mDevice && mVirtualHeight >= mHeight * 2;
+}
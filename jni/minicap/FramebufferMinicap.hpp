@@ -0,0 +1,86 @@
+#ifndef MINICAP_FRAMEBUFFER_MINICAP_HPP
+#define MINICAP_FRAMEBUFFER_MINICAP_HPP
+
+#include <stddef.h>
+
+#include <chrono>
+#include <string>
+
+#include "Minicap.hpp"
+
+// Captures straight from a Linux framebuffer device such as
+// /dev/graphics/fb0. The device is mapped once and frames point into the
+// mapping, so nothing is copied before conversion. When the framebuffer
+// is page flipped (yres_virtual holds more than one screen) the page
+// currently being scanned out, as given by yoffset, is always a completed
+// one and frames don't tear.
+//
+// A regular file works as a stand-in for the device, e.g. for testing on
+// a desktop. Its geometry can't be queried, so it is taken to hold a
+// single RGBA page of the size passed to setRealInfo().
+class FramebufferMinicap: public Minicap {
+public:
+  FramebufferMinicap(const std::string& path, int32_t displayId);
+
+  virtual
+  ~FramebufferMinicap();
+
+  virtual int
+  applyConfigChanges();
+
+  virtual int
+  consumePendingFrame(Frame* frame);
+
+  virtual CaptureMethod
+  getCaptureMethod();
+
+  virtual int32_t
+  getDisplayId();
+
+  virtual void
+  release();
+
+  virtual void
+  releaseConsumedFrame(Frame* frame);
+
+  virtual int
+  setDesiredInfo(const DisplayInfo& info);
+
+  virtual void
+  setFrameAvailableListener(FrameAvailableListener* listener);
+
+  virtual int
+  setRealInfo(const DisplayInfo& info);
+
+  // Whether frames are read from a flipped page and can't tear. Only
+  // meaningful after applyConfigChanges().
+  bool
+  isTearFree();
+
+private:
+  std::string mPath;
+  int32_t mDisplayId;
+  FrameAvailableListener* mListener;
+  DisplayInfo mRealInfo;
+
+  int mFd;
+  unsigned char* mMapping;
+  size_t mMappingSize;
+  bool mDevice;
+  bool mVsync;
+  uint32_t mWidth;
+  uint32_t mHeight;
+  uint32_t mVirtualHeight;
+  uint32_t mLineLength;
+  uint32_t mBpp;
+  Format mFormat;
+  std::chrono::steady_clock::time_point mNextFrame;
+
+  int
+  readGeometry();
+
+  int
+  activeOffset(size_t* offset);
+};
+
+#endif
@@ -0,0 +1,127 @@
+#include "HttpRequest.hpp"
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+
+#include <sstream>
+
+#include "util/debug.h"
+
+static std::string
+trim(const std::string& value) {
+  size_t first = value.find_first_not_of(" \t");
+  size_t last = value.find_last_not_of(" \t\r");
+
+  if (first == std::string::npos) {
+    return std::string();
+  }
+
+  return value.substr(first, last - first + 1);
+}
+
+HttpRequest::Sniff
+HttpRequest::sniff(int fd) {
+  char method[4];
+  ssize_t got = recv(fd, method, sizeof(method), MSG_PEEK | MSG_DONTWAIT);
+
+  if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return SNIFF_WAIT;
+  }
+
+  // A command sent before the banner arrived is no reason to switch.
+  return got > 0 && memcmp(method, "GET ", got) == 0 ? SNIFF_HTTP : SNIFF_OTHER;
+}
+
+int
+HttpRequest::readAvailable(int fd) {
+  char chunk[512];
+
+  // Clients wait for our response before sending anything else, so there's
+  // no harm in reading in chunks.
+  while (mHead.find("\r\n\r\n") == std::string::npos) {
+    if (mHead.size() > MAX_HEAD_SIZE) {
+      MCWARN("HTTP request head too large");
+      return -1;
+    }
+
+    ssize_t got = recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      return 0;
+    }
+
+    if (got <= 0) {
+      return -1;
+    }
+
+    mHead.append(chunk, got);
+  }
+
+  return parse(mHead.substr(0, mHead.find("\r\n\r\n"))) ? 1 : -1;
+}
+
+bool
+HttpRequest::parse(const std::string& head) {
+  std::istringstream lines(head);
+  std::string line;
+
+  if (!std::getline(lines, line)) {
+    return false;
+  }
+
+  std::istringstream requestLine(line);
+  std::string version;
+
+  if (!(requestLine >> mMethod >> mPath >> version)) {
+    MCWARN("Invalid HTTP request line");
+    return false;
+  }
+
+  mHeaders.clear();
+
+  while (std::getline(lines, line)) {
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+
+    mHeaders.push_back(std::make_pair(trim(line.substr(0, colon)), trim(line.substr(colon + 1))));
+  }
+
+  return true;
+}
+
+std::string
+HttpRequest::getHeader(const char* name) const {
+  for (auto& header: mHeaders) {
+    if (strcasecmp(header.first.c_str(), name) == 0) {
+      return header.second;
+    }
+  }
+
+  return std::string();
+}
+
+bool
+HttpRequest::hasToken(const char* name, const char* token) const {
+  std::istringstream tokens(getHeader(name));
+  std::string value;
+
+  while (std::getline(tokens, value, ',')) {
+    if (strcasecmp(trim(value).c_str(), token) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool
+HttpRequest::respond(int fd, const char* status) {
+  std::string response = std::string("HTTP/1.1 ") + status +
+    "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+  return send(fd, response.data(), response.size(), MSG_NOSIGNAL) ==
+    static_cast<ssize_t>(response.size());
+}
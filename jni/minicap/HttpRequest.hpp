@@ -0,0 +1,68 @@
+#ifndef MINICAP_HTTP_REQUEST_HPP
+#define MINICAP_HTTP_REQUEST_HPP
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// The head of an HTTP/1.1 request, read straight off a freshly accepted
+// connection. Raw protocol clients wait for the banner without saying
+// anything, so a client that speaks first is taken to be a browser.
+// Nothing here blocks; the caller keeps calling until it knows.
+class HttpRequest {
+public:
+  enum Sniff {
+    // Nothing has arrived yet.
+    SNIFF_WAIT,
+    SNIFF_HTTP,
+    SNIFF_OTHER,
+  };
+
+  // Whether the client has started sending an HTTP request. Nothing is
+  // consumed.
+  static Sniff
+  sniff(int fd);
+
+  // Reads what has arrived of the request line and headers, but nothing
+  // past them. Returns 1 once they're complete and parsed, 0 if more is
+  // to come, or -1 if the request is broken or the client went away.
+  int
+  readAvailable(int fd);
+
+  // Writes a response without a body and with the given status line, e.g.
+  // "404 Not Found".
+  static bool
+  respond(int fd, const char* status);
+
+  const std::string&
+  getMethod() const {
+    return mMethod;
+  }
+
+  const std::string&
+  getPath() const {
+    return mPath;
+  }
+
+  // Case-insensitive, empty if missing.
+  std::string
+  getHeader(const char* name) const;
+
+  // Whether a comma separated header lists the token, case-insensitively.
+  bool
+  hasToken(const char* name, const char* token) const;
+
+private:
+  static const size_t MAX_HEAD_SIZE = 8192;
+
+  // Read so far.
+  std::string mHead;
+  std::string mMethod;
+  std::string mPath;
+  std::vector<std::pair<std::string, std::string>> mHeaders;
+
+  bool
+  parse(const std::string& head);
+};
+
+#endif
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <stdexcept>
 
 #include "JpgEncoder.hpp"
@@ -26,8 +27,15 @@
 YUVEncoder::YUVEncoder(uint32 fourcc) :
 	handle(tjInitCompress()),
 	fourcc(fourcc),
-	count(0)
+	count(0),
+	scale(1),
+	mI420Output(NULL),
+	mDownscale(1),
+	mSourceFormat(Minicap::FORMAT_RGBA_8888)
 {
+	rawFrame.data = NULL;
+	scaledFrame.data = NULL;
+	nvFrame.data = NULL;
 	MCINFO("YUVEncoder created with corlor format %d", fourcc);
 }
 
@@ -38,6 +46,24 @@ YUVEncoder::~YUVEncoder() {
 	tjFree(nvFrame.data);
 }
 
+bool
+Crop::parse(Crop& crop, const char* value) {
+	Crop parsed;
+	int n = sscanf(value, "%u,%u,%u,%u,%f",
+		&parsed.x, &parsed.y, &parsed.width, &parsed.height, &parsed.scale);
+
+	if (n != 4 && n != 5) {
+		return false;
+	}
+
+	if (parsed.scale < 0) {
+		return false;
+	}
+
+	crop = parsed;
+	return true;
+}
+
 /*
   RGB与YUV格式的文件，均有标准的计算公式
   RGB（长 * 宽 * 每个像素点的空间）
@@ -54,81 +80,425 @@ YUVEncoder::reserveData(uint32_t width, uint32_t height, float scale) {
 
 	//rawFrame
 	int resolution = width * height;
+	tjFree(rawFrame.data);
 	rawFrame.height = height;
 	rawFrame.width = width;
 	rawFrame.size = tjBufSizeYUV2(width, 1/*1或4均可，但不能是0  */, height, TJSAMP_420);
 	rawFrame.data = (unsigned char *)tjAlloc(rawFrame.size);
-	if (rawFrame.data != NULL) {
-		MCINFO("Alloc %d bytes buffer for yuv encoding raw buffer", rawFrame.size);
-		rawFrame.y = rawFrame.data;
-		rawFrame.u = rawFrame.y + resolution;
-		rawFrame.v = rawFrame.u + resolution / 4;
+	if (rawFrame.data == NULL) {
+		return false;
+	}
+
+	MCINFO("Alloc %d bytes buffer for yuv encoding raw buffer", rawFrame.size);
+	rawFrame.y = rawFrame.data;
+	rawFrame.u = rawFrame.y + resolution;
+	rawFrame.v = rawFrame.u + resolution / 4;
+
+	this->scale = scale;
+
+	return reserveOutput();
+}
+
+bool
+YUVEncoder::setCrop(const Crop& crop) {
+	Crop clamped = crop;
+
+	if (clamped.active()) {
+		// Chroma is subsampled 2x2, keep the region on even coordinates.
+		clamped.x = std::min<uint32_t>(clamped.x, rawFrame.width - 2) & ~1;
+		clamped.y = std::min<uint32_t>(clamped.y, rawFrame.height - 2) & ~1;
+		clamped.width = std::min<uint32_t>(clamped.width, rawFrame.width - clamped.x) & ~1;
+		clamped.height = std::min<uint32_t>(clamped.height, rawFrame.height - clamped.y) & ~1;
+
+		if (!clamped.active()) {
+			return false;
+		}
+
+		MCINFO("Cropping to %dx%d at %d,%d", clamped.width, clamped.height, clamped.x, clamped.y);
 	}
 
-	int dest_width = width * scale;
-	int dest_height = height * scale;
-	int dest_resolution = dest_width * dest_height;
+	this->crop = clamped;
+	mRequestedCrop = crop;
+
+	return reserveOutput();
+}
+
+bool
+YUVEncoder::setFourcc(uint32 fourcc) {
+	if (fourcc != FOURCC_I420 && fourcc != FOURCC_NV12 && fourcc != FOURCC_I400) {
+		return false;
+	}
+
+	this->fourcc = fourcc;
+
+	return rawFrame.data == NULL || reserveOutput();
+}
+
+bool
+YUVEncoder::setDownscale(float factor) {
+	if (factor <= 0 || factor > 1) {
+		return false;
+	}
+
+	mDownscale = factor;
+
+	return rawFrame.data == NULL || reserveOutput();
+}
+
+bool
+YUVEncoder::fitFrame(uint32_t width, uint32_t height) {
+	if (rawFrame.data != NULL && width == static_cast<uint32_t>(rawFrame.width) &&
+			height == static_cast<uint32_t>(rawFrame.height)) {
+		return true;
+	}
+
+	MCINFO("Captured frames are %dx%d, adjusting buffers", width, height);
+
+	// Keep the output width as it was.
+	float factor = scale * rawFrame.width / width;
+	crop = Crop();
+
+	if (!reserveData(width, height, factor)) {
+		return false;
+	}
+
+	if (mRequestedCrop.active() && !setCrop(mRequestedCrop)) {
+		MCWARN("Crop doesn't fit %dx%d frames, sending them whole", width, height);
+		crop = Crop();
+		return reserveOutput();
+	}
+
+	return true;
+}
+
+// (Re)allocates the scaled and output buffers for the current crop and
+// scale. The raw buffer always fits the full frame so a crop never needs
+// a bigger one.
+bool
+YUVEncoder::reserveOutput() {
+	float factor = scale;
+	int source_width = rawFrame.width;
+	int source_height = rawFrame.height;
+
+	if (crop.active()) {
+		source_width = crop.width;
+		source_height = crop.height;
+		if (crop.scale > 0) {
+			factor = crop.scale;
+		}
+	}
+
+	factor *= mDownscale;
+
+	// Rounded so that a factor computed from a negotiated size lands on
+	// exactly that size.
+	int dest_width = static_cast<int>(source_width * factor + 0.5f) & ~1;
+	int dest_height = static_cast<int>(source_height * factor + 0.5f) & ~1;
+
+	if (dest_width <= 0 || dest_height <= 0) {
+		return false;
+	}
+
+	// Without scaling the scaled buffer is skipped altogether, and luma is
+	// scaled straight into the output.
+	bool scaling = (dest_width != source_width || dest_height != source_height) &&
+		fourcc != FOURCC_I400;
+	int output_size = fourcc == FOURCC_I400
+		? dest_width * dest_height
+		: tjBufSizeYUV2(dest_width, 1, dest_height, TJSAMP_420);
+
+	if (nvFrame.data != NULL && dest_width == nvFrame.width && dest_height == nvFrame.height &&
+			scaling == (scaledFrame.data != NULL)) {
+		nvFrame.size = output_size;
+		return true;
+	}
+
+	tjFree(scaledFrame.data);
+	scaledFrame.data = NULL;
+
 	YuvFrame *frames[] = {
-	  &scaledFrame,
-	  &nvFrame
+	  &nvFrame,
+	  &scaledFrame
 	};
-	MCINFO("Reserving scaled & vn12 buffer for resolution %dx%d ", dest_width, dest_height);
-	for (int i = 0; i < 2; i++)
+	MCINFO("Reserving %s buffers for resolution %dx%d ", scaling ? "scaled & output" : "output",
+		dest_width, dest_height);
+	for (int i = 0; i < (scaling ? 2 : 1); i++)
 	{
+		tjFree(frames[i]->data);
 		frames[i]->width = dest_width;
 		frames[i]->height = dest_height;
 		frames[i]->size = tjBufSizeYUV2(dest_width, 1/*1或4均可，但不能是0  */, dest_height, TJSAMP_420);
 		frames[i]->data = (unsigned char *)tjAlloc(frames[i]->size);
-		if (frames[i]->data != NULL) {
-			MCINFO("Alloc %d bytes buffer for yuv encoding buffer[%d]", frames[i]->size, i);
-			frames[i]->y = frames[i]->data;
-			frames[i]->u = frames[i]->y + dest_width * dest_height;
-			frames[i]->v = frames[i]->u + dest_width * dest_height / 4;
+		if (frames[i]->data == NULL) {
+			return false;
 		}
+		MCINFO("Alloc %d bytes buffer for yuv encoding buffer[%d]", frames[i]->size, i);
+		frames[i]->y = frames[i]->data;
+		frames[i]->u = frames[i]->y + dest_width * dest_height;
+		frames[i]->v = frames[i]->u + dest_width * dest_height / 4;
 	}
 
+	nvFrame.size = output_size;
+
 	return true;
 }
 
+// libyuv names formats by their byte order in a little endian word, so
+// Android's RGBA is libyuv's ABGR, BGRA is ARGB and RGB (red first in
+// memory) is RAW.
+typedef int (*I420Converter)(const uint8*, int, uint8*, int, uint8*, int,
+	uint8*, int, int, int);
+typedef int (*ARGBConverter)(const uint8*, int, uint8*, int, int, int);
+
+static I420Converter
+i420_converter(Minicap::Format format) {
+	switch (format) {
+	case Minicap::FORMAT_RGBA_8888:
+	case Minicap::FORMAT_RGBX_8888:
+		return ABGRToI420;
+	case Minicap::FORMAT_BGRA_8888:
+		return ARGBToI420;
+	case Minicap::FORMAT_RGB_888:
+		return RAWToI420;
+	case Minicap::FORMAT_RGB_565:
+		return RGB565ToI420;
+	default:
+		return NULL;
+	}
+}
+
+static ARGBConverter
+argb_converter(Minicap::Format format) {
+	switch (format) {
+	case Minicap::FORMAT_RGBA_8888:
+	case Minicap::FORMAT_RGBX_8888:
+		return ABGRToARGB;
+	case Minicap::FORMAT_BGRA_8888:
+		return ARGBCopy;
+	case Minicap::FORMAT_RGB_888:
+		return RAWToARGB;
+	case Minicap::FORMAT_RGB_565:
+		return RGB565ToARGB;
+	default:
+		return NULL;
+	}
+}
+
+// Rows per conversion call in gray mode.
+#define GRAY_BLOCK_ROWS 16
+
+// Only luma is computed, at source resolution. libyuv only converts ARGB
+// to luma, so each block of rows is converted to ARGB first; the block
+// stays in cache throughout.
+bool
+YUVEncoder::encodeGray(const uint8 *source, int source_stride, int width,
+		uint8 *luma, int first, int rows) {
+	mRows.resize(width * 4 * GRAY_BLOCK_ROWS);
+
+	for (int y = first; y < first + rows; y += GRAY_BLOCK_ROWS) {
+		int block = std::min(GRAY_BLOCK_ROWS, first + rows - y);
+
+		if (argb_converter(mSourceFormat)(source + y * source_stride, source_stride,
+					mRows.data(), width * 4, width, block) != 0 ||
+				ARGBToI400(mRows.data(), width * 4,
+					luma + y * width, width, width, block) != 0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool
+YUVEncoder::encodeRows(const uint8 *source, int source_stride, unsigned char *output,
+		int first, int rows) {
+	int width = nvFrame.width;
+	int height = nvFrame.height;
+	const uint8 *band = source + first * source_stride;
+	I420Converter convert = i420_converter(mSourceFormat);
+
+	switch (fourcc) {
+	case FOURCC_I400:
+		return encodeGray(source, source_stride, width, output, first, rows);
+	case FOURCC_I420:
+		return convert(band, source_stride,
+			output + first * width, width,
+			output + width * height + first / 2 * width / 2, width / 2,
+			output + width * height * 5 / 4 + first / 2 * width / 2, width / 2,
+			width, rows) == 0;
+	default: {
+		// The raw buffer keeps the I420 planes around for renditions.
+		uint8 *raw_y = rawFrame.y + first * width;
+		uint8 *raw_u = rawFrame.y + width * height + first / 2 * width / 2;
+		uint8 *raw_v = rawFrame.y + width * height * 5 / 4 + first / 2 * width / 2;
+
+		return convert(band, source_stride,
+				raw_y, width, raw_u, width / 2, raw_v, width / 2, width, rows) == 0 &&
+			I420ToNV12(raw_y, width, raw_u, width / 2, raw_v, width / 2,
+				output + first * width, width,
+				output + width * height + first / 2 * width, width,
+				width, rows) == 0;
+	}
+	}
+}
+
 bool YUVEncoder::encode(Minicap::Frame *frame) {
-	MCINFO("Frame Format: %d\r\n", JpgEncoder::convertFormat(frame->format));
+	return encode(frame, nvFrame.data);
+}
+
+bool YUVEncoder::encode(Minicap::Frame *frame, unsigned char *output) {
+	return encode(frame, output, 0, BandListener());
+}
+
+bool YUVEncoder::encode(Minicap::Frame *frame, unsigned char *output, uint32_t bandRows,
+		const BandListener& listener) {
+	MCINFO("Frame Format: %d\r\n", frame->format);
+
+	if (i420_converter(frame->format) == NULL) {
+		MCERROR("Unsupported pixel format %d", frame->format);
+		return false;
+	}
+
+	mSourceFormat = frame->format;
+
+	// Only the region of interest is read from the (stride padded) source,
+	// packed tightly into the raw buffer.
+	uint32_t source_x = 0;
+	uint32_t source_y = 0;
+	int source_width = frame->width;
+	int source_height = frame->height;
+
+	if (crop.active()) {
+		source_x = crop.x;
+		source_y = crop.y;
+		source_width = std::min<uint32_t>(crop.width, frame->width - std::min(crop.x, frame->width));
+		source_height = std::min<uint32_t>(crop.height, frame->height - std::min(crop.y, frame->height));
+	}
+
+	if (source_width <= 0 || source_height <= 0 ||
+			source_width * source_height > rawFrame.width * rawFrame.height) {
+		MCERROR("Frame of %dx%d does not fit the reserved buffers", frame->width, frame->height);
+		return false;
+	}
+
+	int source_stride = frame->bpp * frame->stride;
+	const uint8 *source = (const uint8 *)frame->data
+		+ source_y * source_stride + source_x * frame->bpp;
+
+	uint32_t height = nvFrame.height;
+	bandRows = bandRows == 0 || bandRows >= height ? height : (bandRows + 1) & ~1;
+
+	bool scaling = source_width != nvFrame.width || source_height != nvFrame.height;
+
+	// When the capture already has the output size, I420 can be written
+	// straight to the output and NV12 only needs a plane interleave, both
+	// band by band.
+	if (!scaling) {
+		mI420Output = fourcc == FOURCC_NV12 ? rawFrame.data : output;
+
+		for (uint32_t y = 0; y < height; y += bandRows) {
+			uint32_t rows = std::min(bandRows, height - y);
+
+			if (!encodeRows(source, source_stride, output, y, rows)) {
+				return false;
+			}
+
+			if (listener && !listener(y, rows)) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	if (!encodeScaled(source, source_stride, source_width, source_height, output)) {
+		return false;
+	}
+
+	for (uint32_t y = 0; listener && y < height; y += bandRows) {
+		if (!listener(y, std::min(bandRows, height - y))) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool
+YUVEncoder::encodeScaled(const uint8 *source, int source_stride, int source_width,
+		int source_height, unsigned char *output) {
+	uint8 *raw_y = rawFrame.y;
+	uint8 *raw_u = raw_y + source_width * source_height;
+	uint8 *raw_v = raw_u + source_width * source_height / 4;
+
+	// Luma only is computed at source resolution, then scaled as a single
+	// plane.
+	if (fourcc == FOURCC_I400) {
+		if (!encodeGray(source, source_stride, source_width, raw_y, 0, source_height)) {
+			return false;
+		}
+
+		ScalePlane(raw_y, source_width, source_width, source_height,
+			output, nvFrame.width, nvFrame.width, nvFrame.height,
+			kFilterNone);
+
+		mI420Output = output;
+		return true;
+	}
+
+	if (scaledFrame.data == NULL) {
+		MCERROR("Frame of %dx%d needs scaling but no buffer was reserved", source_width, source_height);
+		return false;
+	}
 
 	//int ret = tjEncodeYUV3(handle, (unsigned char *)frame->data, frame->width, 
 	//  frame->bpp * frame->stride, /* 设置为0等价于width * tjPixelSize[pixelFormat] */
 	//  frame->height, TJPF_RGBA, rawFrame.data, 1, TJSAMP_420, TJFLAG_FASTDCT | TJFLAG_NOREALLOC);  
-	int ret = ABGRToI420((uint8 *)frame->data, frame->bpp * frame->stride,
-		rawFrame.y, rawFrame.width,
-		rawFrame.u, rawFrame.width / 2,
-		rawFrame.v, rawFrame.width / 2,
-		frame->width, frame->height);
+	int ret = i420_converter(mSourceFormat)(source, source_stride,
+		raw_y, source_width,
+		raw_u, source_width / 2,
+		raw_v, source_width / 2,
+		source_width, source_height);
 	if (ret < 0)
 	{
 		MCINFO("encode to yuv failed: %s\n", tjGetErrorStr());
 	}
 
-
-	ret = I420Scale(rawFrame.y, rawFrame.width,
-		rawFrame.u, rawFrame.width / 2,
-		rawFrame.v, rawFrame.width / 2,
-		false ? -rawFrame.width : rawFrame.width, rawFrame.height,
+	ret = I420Scale(raw_y, source_width,
+		raw_u, source_width / 2,
+		raw_v, source_width / 2,
+		source_width, source_height,
 		scaledFrame.y, scaledFrame.width,
 		scaledFrame.u, scaledFrame.width / 2,
 		scaledFrame.v, scaledFrame.width / 2,
 		scaledFrame.width, scaledFrame.height,
 		kFilterNone);
 
+	mI420Output = scaledFrame.data;
+
 	//uint32 fourcc = FOURCC_NV12;
 
 	ret = ConvertFromI420(scaledFrame.y, scaledFrame.width,
 		scaledFrame.u, scaledFrame.width / 2,
 		scaledFrame.v, scaledFrame.width / 2,
-		nvFrame.data, nvFrame.width,
+		output, nvFrame.width,
 		nvFrame.width, nvFrame.height,
 		fourcc);
 
 	MCINFO("ret = [%d],[%d]Raw data encode into %dK yuv data!", ret, count++, nvFrame.size / 1024);
 	return ret == 0;
 }
+
+YuvFrame
+YUVEncoder::getI420Output() {
+	YuvFrame frame = nvFrame;
+	frame.data = mI420Output;
+	frame.y = mI420Output;
+	frame.u = frame.y + nvFrame.width * nvFrame.height;
+	frame.v = frame.u + nvFrame.width * nvFrame.height / 4;
+	return frame;
+}
+
 int
 YUVEncoder::getEncodedSize() {
 	return nvFrame.size;
@@ -359,6 +729,27 @@ JpgEncoder::encode(Minicap::Frame* frame, unsigned int quality) {
 	  unsigned long mDecompressBufferSize;
 	*/
 
+	// Nothing to resize, compress straight from the frame in one pass.
+	if (mScaling == 1) {
+		unsigned char* offset = getEncodedData() + mPrePadding;
+
+		int ret = tjCompress2(
+			mTjCompressHandle,
+			(unsigned char*)frame->data,
+			frame->width,
+			frame->stride * frame->bpp,
+			frame->height,
+			convertFormat(frame->format),
+			&offset,
+			&mEncodedSize,
+			mSubsampling,
+			quality,
+			TJFLAG_FASTDCT | TJFLAG_NOREALLOC
+		);
+
+		return ret == 0;
+	}
+
 	unsigned long compressDataSize = 0;
 	int ret = tjCompress2(
 		mTjCompressHandle,
@@ -404,6 +795,24 @@ JpgEncoder::encode(Minicap::Frame* frame, unsigned int quality) {
 	return ret == 0;
 }
 
+bool
+JpgEncoder::encode(const YuvFrame& frame, unsigned int quality, unsigned char* output,
+		unsigned long* size) {
+	unsigned char* planes[] = {frame.y, frame.u, frame.v};
+	int strides[] = {frame.width, frame.width / 2, frame.width / 2};
+
+	*size = getMaxSize(frame.width, frame.height);
+
+	return tjCompressFromYUVPlanes(mTjCompressHandle, planes,
+		frame.width, strides, frame.height, TJSAMP_420,
+		&output, size, quality, TJFLAG_FASTDCT | TJFLAG_NOREALLOC) == 0;
+}
+
+unsigned long
+JpgEncoder::getMaxSize(uint32_t width, uint32_t height) {
+	return tjBufSize(width, height, TJSAMP_420);
+}
+
 int
 JpgEncoder::getEncodedSize() {
 	return mEncodedSize;
@@ -419,32 +828,37 @@ bool
 JpgEncoder::reserveData(uint32_t width, uint32_t height) {
 	//printf("reserver data buffer for %dx%d", width, height);
 	if (width == mMaxWidth && height == mMaxHeight) {
-		return 0;
+		return true;
 	}
 
 	tjFree(mCompressBuffer);
-
-	mCompressBufferSize = tjBufSize(
-		width,
-		height,
-		mSubsampling
-	);
-	MCINFO("Allocating %ld bytes for JPG resizer compression", mCompressBufferSize);
-	mCompressBuffer = tjAlloc(mCompressBufferSize);
-	//printf("%x\r\n", mCompressBuffer);
-
-
+	mCompressBuffer = NULL;
 	tjFree(mDecompressBuffer);
-	mDecompressBufferSize = tjBufSize(
-		width,
-		height,
-		mSubsampling
-	);
-	mDecompressBufferSize = (width*mScaling) * 4 * (height*mScaling);
-	MCINFO("Allocating %ld bytes for JPG resizer decompression", mDecompressBufferSize);
-	mDecompressBuffer = tjAlloc(mDecompressBufferSize);
-	//printf("%x\r\n", mDecompressBuffer);
-
+	mDecompressBuffer = NULL;
+
+	// The resizer buffers are only needed for the compress/decompress
+	// scaling round trip.
+	if (mScaling != 1) {
+		mCompressBufferSize = tjBufSize(
+			width,
+			height,
+			mSubsampling
+		);
+		MCINFO("Allocating %ld bytes for JPG resizer compression", mCompressBufferSize);
+		mCompressBuffer = tjAlloc(mCompressBufferSize);
+		//printf("%x\r\n", mCompressBuffer);
+
+
+		mDecompressBufferSize = tjBufSize(
+			width,
+			height,
+			mSubsampling
+		);
+		mDecompressBufferSize = (width*mScaling) * 4 * (height*mScaling);
+		MCINFO("Allocating %ld bytes for JPG resizer decompression", mDecompressBufferSize);
+		mDecompressBuffer = tjAlloc(mDecompressBufferSize);
+		//printf("%x\r\n", mDecompressBuffer);
+	}
 
 	tjFree(mEncodedData);
 
@@ -3,6 +3,8 @@
 
 #include <turbojpeg.h>
 #include <libyuv.h>
+#include <functional>
+#include <vector>
 #include "Minicap.hpp"
 using namespace libyuv;
 class ScalingFactor {
@@ -45,6 +47,29 @@ private:
 };
 
 
+// Region of interest inside the captured frame, in frame pixels. A zero
+// width or height selects the whole frame, a zero scale falls back to the
+// encoder's own scale.
+struct Crop {
+  uint32_t x;
+  uint32_t y;
+  uint32_t width;
+  uint32_t height;
+  float scale;
+
+  Crop(): x(0), y(0), width(0), height(0), scale(0) {
+  }
+
+  bool
+  active() const {
+    return width > 0 && height > 0;
+  }
+
+  // Parses "<x>,<y>,<w>,<h>[,<scale>]".
+  static bool
+  parse(Crop& crop, const char* value);
+};
+
 struct YuvFrame {
     int width;
     int height;
@@ -57,6 +82,10 @@ struct YuvFrame {
 
 class YUVEncoder {
 public:
+  // Called with each band of output rows as soon as it is complete.
+  // Returning false aborts the conversion.
+  typedef std::function<bool(uint32_t firstRow, uint32_t rows)> BandListener;
+
   YUVEncoder(uint32 fourcc);
 
   ~YUVEncoder();
@@ -64,14 +93,56 @@ public:
   bool 
   reserveData(uint32_t width, uint32_t height, float scale);
 
+  // Restricts conversion to a region of the captured frame. Only the
+  // region is read from the source buffer, so a small crop is much cheaper
+  // than a full frame. Pass an inactive Crop to go back to full frames.
+  bool
+  setCrop(const Crop& crop);
+
+  // Switches the output format between FOURCC_I420, FOURCC_NV12 and
+  // FOURCC_I400 (luma only).
+  bool
+  setFourcc(uint32 fourcc);
+
+  // Shrinks the output by a further factor in (0, 1], on top of the scale
+  // and crop. Used by rate control.
+  bool
+  setDownscale(float factor);
+
+  // Re-reserves the buffers if frames turn out to have a different size
+  // than reserved for, keeping the output width and crop. A crop that
+  // doesn't fit the odd frame is kept for the ones it fits again.
+  bool
+  fitFrame(uint32_t width, uint32_t height);
+
   bool
   encode(Minicap::Frame *frame);
 
+  // Same as above, but writes the result to the given buffer of at least
+  // getEncodedSize() bytes instead of the internal one.
+  bool
+  encode(Minicap::Frame *frame, unsigned char *output);
+
+  // Converts in bands of (even) bandRows output rows, telling the listener
+  // about each one so that it can go out while the rest is converted.
+  // Frames that need scaling are converted whole first, then reported band
+  // by band all the same.
+  bool
+  encode(Minicap::Frame *frame, unsigned char *output, uint32_t bandRows,
+    const BandListener& listener);
+
   int 
   getEncodedSize();
 
   unsigned char*
   getEncodedData();
+
+  // The I420 planes of the last frame at output size, for deriving further
+  // renditions from. If the output format is I420 these are the output
+  // itself, so the buffer passed to encode() has to still be around. With
+  // FOURCC_I400 only the Y plane is there.
+  YuvFrame
+  getI420Output();
 /*
   struct Frame {
     void const* data;
@@ -92,7 +163,35 @@ public:
   YuvFrame scaledFrame;
   YuvFrame nvFrame;
   unsigned int count;
+  float scale;
+  Crop crop;
+
+private:
+  unsigned char *mI420Output;
+  std::vector<uint8> mRows;
+  float mDownscale;
+  // The crop as last set, before clamping it to the frame.
+  Crop mRequestedCrop;
+  // Pixel format of the frame being encoded.
+  Minicap::Format mSourceFormat;
+
+  bool
+  reserveOutput();
 
+  // Converts source rows [first, first + rows) to luma.
+  bool
+  encodeGray(const uint8 *source, int source_stride, int width,
+    uint8 *luma, int first, int rows);
+
+  // Converts source rows [first, first + rows) of an unscaled frame
+  // straight to the output.
+  bool
+  encodeRows(const uint8 *source, int source_stride, unsigned char *output,
+    int first, int rows);
+
+  bool
+  encodeScaled(const uint8 *source, int source_stride, int source_width,
+    int source_height, unsigned char *output);
 };
 
 
@@ -105,6 +204,16 @@ public:
   bool
   encode(Minicap::Frame* frame, unsigned int quality);
 
+  // Compresses I420 planes, such as YUVEncoder::getI420Output(), into the
+  // given buffer of at least getMaxSize() bytes. No color conversion is
+  // needed, so this is much cheaper than starting from RGBA.
+  bool
+  encode(const YuvFrame& frame, unsigned int quality, unsigned char* output,
+    unsigned long* size);
+
+  static unsigned long
+  getMaxSize(uint32_t width, uint32_t height);
+
   int
   getEncodedSize();
 
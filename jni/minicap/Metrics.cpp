@@ -0,0 +1,228 @@
+#include "Metrics.hpp"
+
+#include <poll.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+
+#include "HttpRequest.hpp"
+#include "ThreadPolicy.hpp"
+#include "util/debug.h"
+
+// How long a scraper gets to send its request, and to hang up after the
+// response.
+#define REQUEST_TIMEOUT_MS 1000
+#define LINGER_TIMEOUT_MS 1000
+
+// Milliseconds left until deadline, at least 0.
+static int
+remaining(std::chrono::steady_clock::time_point deadline) {
+  long left = std::chrono::duration_cast<std::chrono::milliseconds>(
+    deadline - std::chrono::steady_clock::now()).count();
+
+  return left > 0 ? static_cast<int>(left) : 0;
+}
+
+static bool
+wait_readable(int fd, int timeout) {
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+
+  return poll(&pfd, 1, timeout) > 0;
+}
+
+// Reads the whole request head, so that closing afterwards doesn't reset
+// the connection over unread data.
+static bool
+read_request(int fd) {
+  std::chrono::steady_clock::time_point deadline =
+    std::chrono::steady_clock::now() + std::chrono::milliseconds(REQUEST_TIMEOUT_MS);
+  HttpRequest request;
+  int result;
+
+  while ((result = request.readAvailable(fd)) == 0) {
+    if (!wait_readable(fd, remaining(deadline))) {
+      return false;
+    }
+  }
+
+  return result > 0;
+}
+
+// Lets the client read everything before the connection goes away: our
+// side is shut down first, and whatever the client still sends is read
+// until it hangs up too.
+static void
+linger_close(int fd) {
+  std::chrono::steady_clock::time_point deadline =
+    std::chrono::steady_clock::now() + std::chrono::milliseconds(LINGER_TIMEOUT_MS);
+  char chunk[256];
+
+  shutdown(fd, SHUT_WR);
+
+  while (wait_readable(fd, remaining(deadline)) &&
+      recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT) > 0) {
+  }
+
+  close(fd);
+}
+
+Metrics gMetrics;
+
+const uint64_t Histogram::BOUNDS[Histogram::BUCKETS] = {
+  250, 500, 1000, 2000, 5000, 10000, 20000, 33000, 50000, 100000, 250000, 1000000,
+};
+
+static void
+write_counter(std::string& out, const char* name, const char* help,
+    const char* type, long long value) {
+  char line[256];
+
+  snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %lld\n",
+    name, help, name, type, name, value);
+  out += line;
+}
+
+void
+Histogram::write(std::string& out, const char* name, const char* help) const {
+  char line[256];
+
+  snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+  out += line;
+
+  // Buckets are cumulative in the exposition format.
+  uint64_t cumulative = 0;
+  for (int i = 0; i <= BUCKETS; ++i) {
+    cumulative += mCounts[i].load(std::memory_order_relaxed);
+
+    if (i < BUCKETS) {
+      snprintf(line, sizeof(line), "%s_bucket{le=\"%g\"} %llu\n",
+        name, BOUNDS[i] / 1e6, (unsigned long long) cumulative);
+    }
+    else {
+      snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n",
+        name, (unsigned long long) cumulative);
+    }
+
+    out += line;
+  }
+
+  snprintf(line, sizeof(line), "%s_sum %g\n%s_count %llu\n",
+    name, mSum.load(std::memory_order_relaxed) / 1e6,
+    name, (unsigned long long) cumulative);
+  out += line;
+}
+
+std::string
+Metrics::format() const {
+  std::string out;
+
+  write_counter(out, "minicap_frames_captured_total",
+    "Frames reported available by the capture backend.", "counter", framesCaptured.get());
+  write_counter(out, "minicap_frames_skipped_total",
+    "Stale frames released without being converted.", "counter", framesSkipped.get());
+  write_counter(out, "minicap_frames_converted_total",
+    "Frames converted by the encoder.", "counter", framesConverted.get());
+  write_counter(out, "minicap_frames_sent_total",
+    "Frames fully written to a client.", "counter", framesSent.get());
+  write_counter(out, "minicap_frames_shifted_total",
+    "Frames sent as a scroll instruction and a strip (-e).", "counter", framesShifted.get());
+  write_counter(out, "minicap_frames_dropped_total",
+    "Converted frames that a sink could not take.", "counter", framesDropped.get());
+  write_counter(out, "minicap_frames_throttled_total",
+    "Frames a congested client sat out.", "counter", framesThrottled.get());
+  write_counter(out, "minicap_bytes_sent_total",
+    "Bytes written to clients, including headers.", "counter", bytesSent.get());
+  write_counter(out, "minicap_udp_packets_sent_total",
+    "Packets sent over UDP (-U).", "counter", packetsSent.get());
+  write_counter(out, "minicap_compress_input_bytes_total",
+    "Raw payload bytes fed to the lossless compressor (-c).", "counter", bytesCompressed.get());
+  write_counter(out, "minicap_clients_accepted_total",
+    "Client connections accepted.", "counter", clientsAccepted.get());
+  write_counter(out, "minicap_clients_connected",
+    "Clients currently connected.", "gauge", clientsConnected.get());
+
+  convertTime.write(out, "minicap_convert_seconds",
+    "Time spent converting a frame.");
+  compressTime.write(out, "minicap_compress_seconds",
+    "Time spent compressing a frame.");
+  sendTime.write(out, "minicap_send_seconds",
+    "Time spent writing a frame to a client.");
+  frameLatency.write(out, "minicap_frame_latency_seconds",
+    "Time from consuming a frame until it was sent.");
+
+  return out;
+}
+
+MetricsServer::MetricsServer()
+  : mStopped(false) {
+}
+
+MetricsServer::~MetricsServer() {
+  mStopped = true;
+
+  if (mThread.joinable()) {
+    mThread.join();
+  }
+}
+
+bool
+MetricsServer::start(int port) {
+  if (mServer.start("minicap-metrics", port) < 0) {
+    MCERROR("Unable to start metrics server on port %d", port);
+    return false;
+  }
+
+  mThread = std::thread(&MetricsServer::run, this);
+
+  MCINFO("Serving metrics on port %d", port);
+
+  return true;
+}
+
+void
+MetricsServer::run() {
+  ThreadPolicy::apply(ThreadPolicy::ROLE_IO);
+
+  while (!mStopped) {
+    int fd = mServer.accept(100);
+    if (fd < 0) {
+      continue;
+    }
+
+    // We don't care what was asked for, but it has to be read.
+    if (!read_request(fd)) {
+      close(fd);
+      continue;
+    }
+
+    std::string body = gMetrics.format();
+
+    char head[160];
+    int headSize = snprintf(head, sizeof(head),
+      "HTTP/1.0 200 OK\r\n"
+      "Content-Type: text/plain; version=0.0.4\r\n"
+      "Content-Length: %d\r\n"
+      "Connection: close\r\n"
+      "\r\n", (int) body.size());
+
+    body.insert(0, head, headSize);
+
+    const char* data = body.data();
+    size_t length = body.size();
+    while (length > 0) {
+      ssize_t wrote = send(fd, data, length, MSG_NOSIGNAL);
+      if (wrote <= 0) {
+        break;
+      }
+      data += wrote;
+      length -= wrote;
+    }
+
+    linger_close(fd);
+  }
+}
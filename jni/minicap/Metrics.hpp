@@ -0,0 +1,158 @@
+#ifndef MINICAP_METRICS_HPP
+#define MINICAP_METRICS_HPP
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "SimpleServer.hpp"
+
+// Lock-free, allocation-free counters and histograms meant to be updated
+// from the frame loop. Everything uses relaxed atomics; readers may see
+// slightly inconsistent values across metrics, which is fine for
+// monitoring.
+class Counter {
+public:
+  Counter(): mValue(0) {
+  }
+
+  void
+  add(uint64_t value = 1) {
+    mValue.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  uint64_t
+  get() const {
+    return mValue.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<uint64_t> mValue;
+};
+
+class Gauge {
+public:
+  Gauge(): mValue(0) {
+  }
+
+  void
+  add(int64_t value) {
+    mValue.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  void
+  set(int64_t value) {
+    mValue.store(value, std::memory_order_relaxed);
+  }
+
+  int64_t
+  get() const {
+    return mValue.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<int64_t> mValue;
+};
+
+// Latency histogram with fixed bucket bounds, in microseconds.
+class Histogram {
+public:
+  static const int BUCKETS = 12;
+  static const uint64_t BOUNDS[BUCKETS];
+
+  Histogram(): mSum(0) {
+    for (int i = 0; i <= BUCKETS; ++i) {
+      mCounts[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  void
+  observe(uint64_t us) {
+    int i = 0;
+    while (i < BUCKETS && us > BOUNDS[i]) {
+      ++i;
+    }
+
+    mCounts[i].fetch_add(1, std::memory_order_relaxed);
+    mSum.fetch_add(us, std::memory_order_relaxed);
+  }
+
+  void
+  write(std::string& out, const char* name, const char* help) const;
+
+private:
+  // One extra for +Inf.
+  std::atomic<uint64_t> mCounts[BUCKETS + 1];
+  std::atomic<uint64_t> mSum;
+};
+
+// Measures the time from construction to stop() and records it.
+class StageTimer {
+public:
+  StageTimer(Histogram& histogram)
+    : mHistogram(histogram),
+      mStart(std::chrono::steady_clock::now()) {
+  }
+
+  uint64_t
+  stop() {
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - mStart).count();
+    mHistogram.observe(us);
+    return us;
+  }
+
+private:
+  Histogram& mHistogram;
+  std::chrono::steady_clock::time_point mStart;
+};
+
+struct Metrics {
+  Counter framesCaptured;
+  Counter framesSkipped;
+  Counter framesConverted;
+  Counter framesSent;
+  Counter framesShifted;
+  Counter framesDropped;
+  Counter framesThrottled;
+  Counter bytesSent;
+  Counter packetsSent;
+  Counter bytesCompressed;
+  Counter clientsAccepted;
+  Gauge clientsConnected;
+  Histogram convertTime;
+  Histogram compressTime;
+  Histogram sendTime;
+  Histogram frameLatency;
+
+  // Renders everything in the Prometheus text exposition format.
+  std::string
+  format() const;
+};
+
+extern Metrics gMetrics;
+
+// Serves gMetrics over HTTP on its own port and thread, e.g. for a
+// Prometheus scraper or `curl`.
+class MetricsServer {
+public:
+  MetricsServer();
+
+  ~MetricsServer();
+
+  bool
+  start(int port);
+
+private:
+  SimpleServer mServer;
+  std::thread mThread;
+  std::atomic<bool> mStopped;
+
+  void
+  run();
+};
+
+#endif
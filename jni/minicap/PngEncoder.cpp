@@ -0,0 +1,264 @@
+#include "PngEncoder.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <zlib.h>
+
+#include "util/debug.h"
+
+// Rows per block. Small enough to keep every worker busy on a phone
+// screen, large enough that the per-block flush costs nothing.
+#define MIN_BLOCK_ROWS 32
+
+enum {
+  PNG_FILTER_NONE = 0,
+  PNG_FILTER_SUB  = 1,
+  PNG_FILTER_UP   = 2,
+};
+
+static void
+put_uint32_be(unsigned char* data, uint32_t value) {
+  data[0] = (value >> 24) & 0xFF;
+  data[1] = (value >> 16) & 0xFF;
+  data[2] = (value >> 8) & 0xFF;
+  data[3] = value & 0xFF;
+}
+
+static void
+append_chunk(std::vector<unsigned char>& out, const char* type,
+    const unsigned char* data, size_t length) {
+  size_t offset = out.size();
+  out.resize(offset + 12 + length);
+
+  unsigned char* chunk = &out[offset];
+  put_uint32_be(chunk, length);
+  memcpy(chunk + 4, type, 4);
+  if (length > 0) {
+    memcpy(chunk + 8, data, length);
+  }
+
+  uLong crc = crc32(0L, Z_NULL, 0);
+  crc = crc32(crc, chunk + 4, length + 4);
+  put_uint32_be(chunk + 8 + length, crc);
+}
+
+// Bytes per output pixel, or 0 if the format is not supported. RGBX
+// loses its padding byte, BGRA gets swizzled to RGBA.
+static unsigned int
+channels_for(Minicap::Format format) {
+  switch (format) {
+  case Minicap::FORMAT_RGBA_8888:
+  case Minicap::FORMAT_BGRA_8888:
+    return 4;
+  case Minicap::FORMAT_RGBX_8888:
+  case Minicap::FORMAT_RGB_888:
+    return 3;
+  default:
+    return 0;
+  }
+}
+
+static void
+convert_row(Minicap::Frame* frame, uint32_t row, unsigned char* out) {
+  const unsigned char* in = static_cast<const unsigned char*>(frame->data)
+    + row * frame->stride * frame->bpp;
+
+  switch (frame->format) {
+  case Minicap::FORMAT_RGBA_8888:
+    memcpy(out, in, frame->width * 4);
+    break;
+  case Minicap::FORMAT_RGB_888:
+    memcpy(out, in, frame->width * 3);
+    break;
+  case Minicap::FORMAT_RGBX_8888:
+    for (uint32_t x = 0; x < frame->width; ++x, in += 4, out += 3) {
+      out[0] = in[0];
+      out[1] = in[1];
+      out[2] = in[2];
+    }
+    break;
+  case Minicap::FORMAT_BGRA_8888:
+    for (uint32_t x = 0; x < frame->width; ++x, in += 4, out += 4) {
+      out[0] = in[2];
+      out[1] = in[1];
+      out[2] = in[0];
+      out[3] = in[3];
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+// Picks the filter with the smallest sum of absolute (signed) residuals,
+// the usual libpng heuristic restricted to the cheap filters.
+static void
+filter_row(const unsigned char* cur, const unsigned char* prev,
+    size_t length, unsigned int bpp, unsigned char* out) {
+  unsigned long sumNone = 0, sumSub = 0, sumUp = 0;
+
+  for (size_t i = 0; i < length; ++i) {
+    unsigned char left = i >= bpp ? cur[i - bpp] : 0;
+    sumNone += abs(static_cast<signed char>(cur[i]));
+    sumSub += abs(static_cast<signed char>(cur[i] - left));
+    sumUp += abs(static_cast<signed char>(cur[i] - prev[i]));
+  }
+
+  if (sumNone <= sumSub && sumNone <= sumUp) {
+    out[0] = PNG_FILTER_NONE;
+    memcpy(out + 1, cur, length);
+  }
+  else if (sumSub <= sumUp) {
+    out[0] = PNG_FILTER_SUB;
+    for (size_t i = 0; i < length; ++i) {
+      out[i + 1] = cur[i] - (i >= bpp ? cur[i - bpp] : 0);
+    }
+  }
+  else {
+    out[0] = PNG_FILTER_UP;
+    for (size_t i = 0; i < length; ++i) {
+      out[i + 1] = cur[i] - prev[i];
+    }
+  }
+}
+
+PngEncoder::PngEncoder(WorkerPool* pool, int level)
+  : mPool(pool),
+    mLevel(level) {
+}
+
+void
+PngEncoder::encodeBlock(Minicap::Frame* frame, unsigned int channels,
+    Block& block, uint32_t firstRow, uint32_t rows, bool last) {
+  size_t rowBytes = frame->width * channels;
+
+  std::vector<unsigned char> lines(rowBytes * 2);
+  unsigned char* prev = &lines[0];
+  unsigned char* cur = &lines[rowBytes];
+
+  // The Up filter of the first row refers to the last row of the previous
+  // block, which is still right there in the source.
+  if (firstRow > 0) {
+    convert_row(frame, firstRow - 1, prev);
+  }
+
+  block.filtered.resize(rows * (rowBytes + 1));
+
+  for (uint32_t i = 0; i < rows; ++i) {
+    convert_row(frame, firstRow + i, cur);
+    filter_row(cur, prev, rowBytes, channels, &block.filtered[i * (rowBytes + 1)]);
+    std::swap(prev, cur);
+  }
+
+  block.adler = adler32(adler32(0L, Z_NULL, 0), &block.filtered[0], block.filtered.size());
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+
+  // Raw deflate; the zlib wrapper is written once around all blocks.
+  if (deflateInit2(&stream, mLevel, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    block.ok = false;
+    return;
+  }
+
+  block.compressed.resize(deflateBound(&stream, block.filtered.size()) + 16);
+
+  stream.next_in = &block.filtered[0];
+  stream.avail_in = block.filtered.size();
+  stream.next_out = &block.compressed[0];
+  stream.avail_out = block.compressed.size();
+
+  // A sync flush ends the block on a byte boundary without marking the
+  // stream final, so the next block can simply be appended.
+  int err = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+
+  block.ok = last ? err == Z_STREAM_END : err == Z_OK;
+  block.compressed.resize(stream.total_out);
+
+  deflateEnd(&stream);
+}
+
+bool
+PngEncoder::encode(Minicap::Frame* frame) {
+  unsigned int channels = channels_for(frame->format);
+  if (channels == 0) {
+    MCERROR("Unsupported pixel format %d for PNG", frame->format);
+    return false;
+  }
+
+  unsigned int count = mPool->size() * 2;
+  uint32_t rowsPerBlock = (frame->height + count - 1) / count;
+  if (rowsPerBlock < MIN_BLOCK_ROWS) {
+    rowsPerBlock = MIN_BLOCK_ROWS;
+  }
+  count = (frame->height + rowsPerBlock - 1) / rowsPerBlock;
+
+  mBlocks.resize(count);
+
+  mPool->parallelFor(count, [&](unsigned int i) {
+    uint32_t firstRow = i * rowsPerBlock;
+    uint32_t rows = std::min(rowsPerBlock, frame->height - firstRow);
+    encodeBlock(frame, channels, mBlocks[i], firstRow, rows, i == count - 1);
+  });
+
+  size_t idatSize = 2 + 4;
+  uLong adler = adler32(0L, Z_NULL, 0);
+
+  for (unsigned int i = 0; i < count; ++i) {
+    if (!mBlocks[i].ok) {
+      MCERROR("Unable to deflate PNG block %d", i);
+      return false;
+    }
+
+    idatSize += mBlocks[i].compressed.size();
+    adler = adler32_combine(adler, mBlocks[i].adler, mBlocks[i].filtered.size());
+  }
+
+  static const unsigned char signature[] = {
+    0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'
+  };
+
+  mEncoded.clear();
+  mEncoded.reserve(sizeof(signature) + 25 + 12 + idatSize + 12);
+  mEncoded.insert(mEncoded.end(), signature, signature + sizeof(signature));
+
+  unsigned char ihdr[13];
+  put_uint32_be(ihdr, frame->width);
+  put_uint32_be(ihdr + 4, frame->height);
+  ihdr[8] = 8;                     // Bit depth.
+  ihdr[9] = channels == 4 ? 6 : 2; // Truecolor with or without alpha.
+  ihdr[10] = 0;                    // Deflate.
+  ihdr[11] = 0;                    // Adaptive filtering.
+  ihdr[12] = 0;                    // No interlace.
+  append_chunk(mEncoded, "IHDR", ihdr, sizeof(ihdr));
+
+  std::vector<unsigned char> idat;
+  idat.reserve(idatSize);
+  idat.push_back(0x78);
+  idat.push_back(0x01);
+
+  for (unsigned int i = 0; i < count; ++i) {
+    idat.insert(idat.end(), mBlocks[i].compressed.begin(), mBlocks[i].compressed.end());
+  }
+
+  idat.resize(idat.size() + 4);
+  put_uint32_be(&idat[idat.size() - 4], adler);
+
+  append_chunk(mEncoded, "IDAT", &idat[0], idat.size());
+  append_chunk(mEncoded, "IEND", NULL, 0);
+
+  return true;
+}
+
+int
+PngEncoder::getEncodedSize() {
+  return mEncoded.size();
+}
+
+unsigned char*
+PngEncoder::getEncodedData() {
+  return &mEncoded[0];
+}
@@ -0,0 +1,45 @@
+#ifndef MINICAP_PNG_ENCODER_HPP
+#define MINICAP_PNG_ENCODER_HPP
+
+#include <stddef.h>
+
+#include <vector>
+
+#include "Minicap.hpp"
+#include "WorkerPool.hpp"
+
+// Lossless screenshot encoder. Rows are split into blocks which are
+// filtered and deflated independently on the worker pool, then stitched
+// together into a single IDAT stream (the same trick pigz uses).
+class PngEncoder {
+public:
+  PngEncoder(WorkerPool* pool, int level = 1);
+
+  bool
+  encode(Minicap::Frame* frame);
+
+  int
+  getEncodedSize();
+
+  unsigned char*
+  getEncodedData();
+
+private:
+  struct Block {
+    std::vector<unsigned char> filtered;
+    std::vector<unsigned char> compressed;
+    unsigned long adler;
+    bool ok;
+  };
+
+  WorkerPool* mPool;
+  int mLevel;
+  std::vector<Block> mBlocks;
+  std::vector<unsigned char> mEncoded;
+
+  void
+  encodeBlock(Minicap::Frame* frame, unsigned int channels, Block& block,
+    uint32_t firstRow, uint32_t rows, bool last);
+};
+
+#endif
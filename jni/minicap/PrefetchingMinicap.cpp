@@ -0,0 +1,189 @@
+#include "PrefetchingMinicap.hpp"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "ThreadPolicy.hpp"
+#include "util/debug.h"
+
+void
+PrefetchingMinicap::BackendListener::onFrameAvailable() {
+  std::unique_lock<std::mutex> lock(mOwner->mMutex);
+  mOwner->mBackendPending += 1;
+  mOwner->mCondition.notify_all();
+}
+
+PrefetchingMinicap::PrefetchingMinicap(Minicap* backend)
+  : mBackend(backend),
+    mBackendListener(this),
+    mListener(NULL),
+    mReady(-1),
+    mConsumed(-1),
+    mBackendPending(0),
+    mError(0),
+    mStopped(false) {
+}
+
+PrefetchingMinicap::~PrefetchingMinicap() {
+  stop();
+}
+
+int
+PrefetchingMinicap::applyConfigChanges() {
+  int err;
+
+  if ((err = mBackend->applyConfigChanges()) != 0) {
+    return err;
+  }
+
+  if (!mThread.joinable()) {
+    mThread = std::thread(&PrefetchingMinicap::run, this);
+  }
+
+  return 0;
+}
+
+int
+PrefetchingMinicap::consumePendingFrame(Frame* frame) {
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  mCondition.wait(lock, [this]{return mReady >= 0 || mError != 0 || mStopped;});
+
+  if (mReady < 0) {
+    return mError != 0 ? mError : -EINTR;
+  }
+
+  mConsumed = mReady;
+  mReady = -1;
+  *frame = mSlots[mConsumed].frame;
+
+  // The slot just became free, so the next capture can start right away.
+  mCondition.notify_all();
+
+  return 0;
+}
+
+Minicap::CaptureMethod
+PrefetchingMinicap::getCaptureMethod() {
+  return mBackend->getCaptureMethod();
+}
+
+int32_t
+PrefetchingMinicap::getDisplayId() {
+  return mBackend->getDisplayId();
+}
+
+void
+PrefetchingMinicap::release() {
+  stop();
+  mBackend->release();
+}
+
+void
+PrefetchingMinicap::releaseConsumedFrame(Frame* /* frame */) {
+  std::unique_lock<std::mutex> lock(mMutex);
+  mConsumed = -1;
+}
+
+int
+PrefetchingMinicap::setDesiredInfo(const DisplayInfo& info) {
+  return mBackend->setDesiredInfo(info);
+}
+
+void
+PrefetchingMinicap::setFrameAvailableListener(FrameAvailableListener* listener) {
+  mListener = listener;
+  mBackend->setFrameAvailableListener(&mBackendListener);
+}
+
+int
+PrefetchingMinicap::setRealInfo(const DisplayInfo& info) {
+  return mBackend->setRealInfo(info);
+}
+
+void
+PrefetchingMinicap::stop() {
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mStopped = true;
+    mCondition.notify_all();
+  }
+
+  if (mThread.joinable()) {
+    mThread.join();
+  }
+}
+
+int
+PrefetchingMinicap::freeSlot() {
+  for (int i = 0; i < SLOTS; ++i) {
+    if (i != mReady && i != mConsumed) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+void
+PrefetchingMinicap::run() {
+  ThreadPolicy::apply(ThreadPolicy::ROLE_CAPTURE);
+
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  while (true) {
+    // Stay one frame ahead at most; capturing further would only produce
+    // frames nobody is going to look at.
+    mCondition.wait(lock, [this]{
+      return mStopped || (mBackendPending > 0 && mReady < 0);
+    });
+
+    if (mStopped) {
+      return;
+    }
+
+    mBackendPending -= 1;
+    Slot& slot = mSlots[freeSlot()];
+    lock.unlock();
+
+    Frame captured;
+    int err = mBackend->consumePendingFrame(&captured);
+
+    if (err == 0) {
+      size_t size = std::min(captured.size,
+        static_cast<size_t>(captured.stride) * captured.height * captured.bpp);
+
+      slot.data.resize(size);
+      memcpy(slot.data.data(), captured.data, size);
+      slot.frame = captured;
+      slot.frame.data = slot.data.data();
+      slot.frame.size = size;
+
+      // May call our listener right back to request the next capture.
+      mBackend->releaseConsumedFrame(&captured);
+    }
+    else {
+      MCERROR("Prefetching capture failed with %d", err);
+    }
+
+    lock.lock();
+
+    if (err != 0) {
+      mError = err;
+      mCondition.notify_all();
+      lock.unlock();
+      mListener->onFrameAvailable();
+      return;
+    }
+
+    mReady = &slot - mSlots;
+    mCondition.notify_all();
+
+    // Never call out with the lock held, the listener may well come back
+    // to consume.
+    lock.unlock();
+    mListener->onFrameAvailable();
+    lock.lock();
+  }
+}
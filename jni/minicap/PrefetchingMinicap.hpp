@@ -0,0 +1,97 @@
+#ifndef MINICAP_PREFETCHING_MINICAP_HPP
+#define MINICAP_PREFETCHING_MINICAP_HPP
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Minicap.hpp"
+
+// Wraps a pull-style backend (METHOD_SCREENSHOT), which only captures when
+// a frame is consumed, and keeps its captures going on a dedicated thread.
+// Frames are copied into one of three slots so that the next capture runs
+// while the caller is still converting the current frame. The capture
+// thread stays at most one frame ahead and never overwrites a frame that
+// hasn't been consumed yet, so the pending frame count stays exact.
+//
+// The wrapped instance is not owned and must outlive this one.
+class PrefetchingMinicap: public Minicap {
+public:
+  PrefetchingMinicap(Minicap* backend);
+
+  virtual
+  ~PrefetchingMinicap();
+
+  virtual int
+  applyConfigChanges();
+
+  virtual int
+  consumePendingFrame(Frame* frame);
+
+  virtual CaptureMethod
+  getCaptureMethod();
+
+  virtual int32_t
+  getDisplayId();
+
+  virtual void
+  release();
+
+  virtual void
+  releaseConsumedFrame(Frame* frame);
+
+  virtual int
+  setDesiredInfo(const DisplayInfo& info);
+
+  virtual void
+  setFrameAvailableListener(FrameAvailableListener* listener);
+
+  virtual int
+  setRealInfo(const DisplayInfo& info);
+
+private:
+  static const int SLOTS = 3;
+
+  struct Slot {
+    std::vector<unsigned char> data;
+    Frame frame;
+  };
+
+  class BackendListener: public FrameAvailableListener {
+  public:
+    BackendListener(PrefetchingMinicap* owner): mOwner(owner) {
+    }
+
+    void
+    onFrameAvailable();
+
+  private:
+    PrefetchingMinicap* mOwner;
+  };
+
+  Minicap* mBackend;
+  BackendListener mBackendListener;
+  FrameAvailableListener* mListener;
+
+  std::thread mThread;
+  std::mutex mMutex;
+  std::condition_variable mCondition;
+  Slot mSlots[SLOTS];
+  int mReady;
+  int mConsumed;
+  int mBackendPending;
+  int mError;
+  bool mStopped;
+
+  void
+  run();
+
+  void
+  stop();
+
+  int
+  freeSlot();
+};
+
+#endif
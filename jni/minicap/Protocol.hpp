@@ -0,0 +1,151 @@
+#ifndef MINICAP_PROTOCOL_HPP
+#define MINICAP_PROTOCOL_HPP
+
+#include <stdint.h>
+
+#include <chrono>
+
+// The first 24 bytes are identical to version 1 so that older clients,
+// which skip anything past the banner length they don't understand, keep
+// working.
+#define BANNER_VERSION 2
+#define BANNER_SIZE 52
+
+// Set in banner[24] when every frame carries a FrameHeader right after its
+// 4-byte length.
+enum {
+  BANNER_FLAG_FRAME_HEADER  = 1,
+  // Raw YUV payloads are wrapped in the lossless container described in
+  // FrameCompressor.hpp (see -c). The frame header still describes the
+  // decoded payload.
+  BANNER_FLAG_COMPRESSED    = 2,
+};
+
+// banner[26] holds the number of renditions (see -p) clients can choose
+// from with "rendition <index>". Rendition 0 is described by the banner.
+
+#define FRAME_HEADER_SIZE 32
+
+enum {
+  FRAME_TYPE_PICTURE  = 0,
+  // A frame replayed from the flight recorder ("flight send").
+  FRAME_TYPE_REPLAY   = 1,
+  // The previous picture scrolled (-e). The payload is a shift record
+  // followed by a strip of the new picture.
+  FRAME_TYPE_SHIFT    = 2,
+  // A band of rows sent while the rest of the picture is still being
+  // converted (-l). The payload is a strip record followed by the rows.
+  FRAME_TYPE_STRIP    = 3,
+};
+
+// Shift record, at the start of FRAME_TYPE_SHIFT payloads. Offsets are in
+// pixels of the full picture, whose size is in the frame header.
+//
+//   0  i32  dx, horizontal movement of the content
+//   4  i32  dy, vertical movement of the content (only one is non-zero)
+//   8  u32  band start
+//   12 u32  band end
+//   16 u32  strip start
+//   20 u32  strip end
+//   24 u32  extent start
+//   28 u32  extent end
+//
+// For a vertical shift, rows [band start, band end) of the new picture are
+// rows [band start - dy, band end - dy) of the previous one. Rows [strip
+// start, strip end) follow the record as a full width picture in the
+// stream format; every other row is unchanged. Horizontal shifts work the
+// same on columns, but only within rows [extent start, extent end), which
+// is also the height of the strip. Rows outside of it are unchanged.
+#define SHIFT_RECORD_SIZE 32
+
+// Strip record, at the start of FRAME_TYPE_STRIP payloads. The frame header
+// describes the whole picture, and every strip of a picture has the same
+// sequence number. Strips arrive top to bottom; the one ending at the
+// picture height completes it.
+//
+//   0  u32  first row
+//   4  u32  rows, a full width picture in the stream format
+#define STRIP_RECORD_SIZE 8
+
+// Payload encodings, as found in banner[25] and the frame header. The raw
+// YUV values match -f.
+enum {
+  FRAME_FORMAT_I420  = 0,
+  FRAME_FORMAT_NV12  = 1,
+  FRAME_FORMAT_JPG   = 2,
+  FRAME_FORMAT_PNG   = 3,
+  // Luma only, one byte per pixel.
+  FRAME_FORMAT_GRAY  = 4,
+  // The captured pixels as they are, four bytes each in R G B A order.
+  // Rows are tightly packed, crop and scale don't apply.
+  FRAME_FORMAT_RGBA  = 5,
+};
+
+static inline void
+putUInt32LE(unsigned char* data, uint32_t value) {
+  data[0] = (value & 0x000000FF) >> 0;
+  data[1] = (value & 0x0000FF00) >> 8;
+  data[2] = (value & 0x00FF0000) >> 16;
+  data[3] = (value & 0xFF000000) >> 24;
+}
+
+// Frame timestamps are microseconds on the monotonic clock.
+static inline uint64_t
+monotonicTimestamp() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Optional per-frame header. When enabled the 4-byte frame length covers
+// both the header and the payload.
+//
+//   0  u8   header size
+//   1  u8   frame type
+//   2  u8   payload format (FRAME_FORMAT_*)
+//   3  u8   rendition (see -p), 0 being the full stream output
+//   4  u32  frame sequence number
+//   8  u32  x of the region origin in captured frame pixels
+//   12 u32  y of the region origin in captured frame pixels
+//   16 u32  payload width
+//   20 u32  payload height
+//   24 u64  capture timestamp in microseconds (monotonic)
+struct FrameHeader {
+  uint8_t type;
+  uint8_t format;
+  uint8_t rendition;
+  uint32_t sequence;
+  uint32_t x;
+  uint32_t y;
+  uint32_t width;
+  uint32_t height;
+  uint64_t timestamp;
+
+  FrameHeader()
+    : type(FRAME_TYPE_PICTURE),
+      format(0),
+      rendition(0),
+      sequence(0),
+      x(0),
+      y(0),
+      width(0),
+      height(0),
+      timestamp(0) {
+  }
+
+  void
+  serialize(unsigned char* data) const {
+    data[0] = FRAME_HEADER_SIZE;
+    data[1] = type;
+    data[2] = format;
+    data[3] = rendition;
+    putUInt32LE(data + 4, sequence);
+    putUInt32LE(data + 8, x);
+    putUInt32LE(data + 12, y);
+    putUInt32LE(data + 16, width);
+    putUInt32LE(data + 20, height);
+    putUInt32LE(data + 24, static_cast<uint32_t>(timestamp));
+    putUInt32LE(data + 28, static_cast<uint32_t>(timestamp >> 32));
+  }
+};
+
+#endif
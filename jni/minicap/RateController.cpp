@@ -0,0 +1,143 @@
+#include "RateController.hpp"
+
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+
+#include <algorithm>
+
+#include "Protocol.hpp"
+#include "util/debug.h"
+
+#define MIN_QUALITY 20
+#define QUALITY_STEP_DOWN 10
+#define QUALITY_STEP_UP 5
+
+#define MIN_SCALE 0.25f
+#define SCALE_STEP_DOWN 0.8f
+#define SCALE_STEP_UP 1.1f
+
+// Stepping up needs the worst delay under a third of the target for a
+// second.
+#define HEADROOM_DIVISOR 3
+#define HEADROOM_US 1000000
+
+// Weight of a new throughput sample.
+#define THROUGHPUT_WEIGHT 0.2
+
+RateController::RateController(unsigned int targetMs, unsigned int maxQuality)
+  : mTarget(static_cast<uint64_t>(targetMs) * 1000),
+    mMaxQuality(maxQuality),
+    mQuality(maxQuality),
+    mScale(1),
+    mLastChange(0),
+    mComfortableSince(0) {
+}
+
+size_t
+RateController::queuedBytes(int fd) {
+  int queued = 0;
+
+  if (ioctl(fd, SIOCOUTQ, &queued) < 0 || queued < 0) {
+    return 0;
+  }
+
+  return queued;
+}
+
+uint64_t
+RateController::delayOf(const Link& link, size_t queued) {
+  if (queued == 0) {
+    return 0;
+  }
+
+  // Nothing known yet, assume the worst until the first sample.
+  if (link.throughput <= 0) {
+    return mTarget + 1;
+  }
+
+  return static_cast<uint64_t>(queued / link.throughput * 1000000);
+}
+
+uint64_t
+RateController::sample(Link& link, int fd) {
+  uint64_t now = monotonicTimestamp();
+  size_t queued = queuedBytes(fd);
+
+  // What left the queue since last time. While the queue runs dry this
+  // only tells us what we offered, but then the delay is small anyway.
+  if (link.time != 0 && now > link.time && link.queued + link.unsampled > queued) {
+    double rate = (link.queued + link.unsampled - queued) * 1000000.0 / (now - link.time);
+
+    link.throughput = link.throughput <= 0 ? rate
+      : link.throughput * (1 - THROUGHPUT_WEIGHT) + rate * THROUGHPUT_WEIGHT;
+  }
+
+  link.time = now;
+  link.queued = queued;
+  link.unsampled = 0;
+
+  return delayOf(link, queued);
+}
+
+bool
+RateController::congested(Link& link, int fd) {
+  return link.time != 0 && delayOf(link, queuedBytes(fd)) > mTarget;
+}
+
+void
+RateController::update(uint64_t delay, bool adjustQuality, bool adjustScale) {
+  uint64_t now = monotonicTimestamp();
+
+  if (delay > mTarget) {
+    mComfortableSince = 0;
+
+    // Give the last change time to show.
+    if (now - mLastChange < mTarget) {
+      return;
+    }
+
+    if (adjustQuality && mQuality > MIN_QUALITY) {
+      mQuality = std::max<unsigned int>(MIN_QUALITY, mQuality - std::min<unsigned int>(mQuality, QUALITY_STEP_DOWN));
+    }
+    else if (adjustScale && mScale > MIN_SCALE) {
+      mScale = std::max(MIN_SCALE, mScale * SCALE_STEP_DOWN);
+    }
+    else {
+      return;
+    }
+
+    MCINFO("Delay %dms over target, quality %d scale %.2f",
+      (int) (delay / 1000), mQuality, mScale);
+    mLastChange = now;
+    return;
+  }
+
+  if (delay > mTarget / HEADROOM_DIVISOR) {
+    mComfortableSince = 0;
+    return;
+  }
+
+  if (mComfortableSince == 0) {
+    mComfortableSince = now;
+    return;
+  }
+
+  if (now - mComfortableSince < HEADROOM_US) {
+    return;
+  }
+
+  // Size first, it's what got taken away last.
+  if (adjustScale && mScale < 1) {
+    mScale = std::min(1.0f, mScale * SCALE_STEP_UP);
+  }
+  else if (adjustQuality && mQuality < mMaxQuality) {
+    mQuality = std::min(mMaxQuality, mQuality + QUALITY_STEP_UP);
+  }
+  else {
+    return;
+  }
+
+  MCINFO("Headroom available, quality %d scale %.2f", mQuality, mScale);
+  mLastChange = now;
+  mComfortableSince = now;
+}
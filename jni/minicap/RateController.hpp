@@ -0,0 +1,83 @@
+#ifndef MINICAP_RATE_CONTROLLER_HPP
+#define MINICAP_RATE_CONTROLLER_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Keeps the latency of a stream under a target on links of unknown and
+// changing capacity (-a). Each client connection is a Link whose
+// throughput is estimated from how fast its socket send queue drains
+// (SIOCOUTQ), and whose delay is what's still queued divided by that.
+//
+// Three knobs are turned, cheapest first:
+//
+//   frame rate  a frame is skipped for a link whose queue alone would
+//               already take longer than the target to drain, so slow
+//               clients get fewer frames without holding up fast ones.
+//   quality     JPEG quality, between 20 and the configured one.
+//   scale       an extra downscale of the output, down to 1/4.
+//
+// Going down happens as soon as the worst link is over the target (at most
+// once per target period, to see the effect first), going back up only
+// after a second of comfortable headroom.
+class RateController {
+public:
+  struct Link {
+    uint64_t time;
+    size_t queued;
+    size_t unsampled;
+    double throughput;
+
+    Link(): time(0), queued(0), unsampled(0), throughput(0) {
+    }
+  };
+
+  RateController(unsigned int targetMs, unsigned int maxQuality);
+
+  // Counts bytes written to the link since the last sample.
+  static void
+  sent(Link& link, size_t bytes) {
+    link.unsampled += bytes;
+  }
+
+  // Updates the throughput estimate from the socket, usually right after a
+  // frame went out. Returns the current delay in microseconds.
+  uint64_t
+  sample(Link& link, int fd);
+
+  // Whether the link is too backed up to take another frame right now.
+  bool
+  congested(Link& link, int fd);
+
+  // Adjusts quality and scale given the worst delay of the frame just sent,
+  // in microseconds. Raw formats have no quality to give, and the size
+  // can only change if clients can tell from the frame header (or JPEG).
+  void
+  update(uint64_t delay, bool adjustQuality, bool adjustScale);
+
+  unsigned int
+  getQuality() {
+    return mQuality;
+  }
+
+  float
+  getScale() {
+    return mScale;
+  }
+
+private:
+  uint64_t mTarget;
+  unsigned int mMaxQuality;
+  unsigned int mQuality;
+  float mScale;
+  uint64_t mLastChange;
+  uint64_t mComfortableSince;
+
+  static size_t
+  queuedBytes(int fd);
+
+  uint64_t
+  delayOf(const Link& link, size_t queued);
+};
+
+#endif
@@ -0,0 +1,265 @@
+#include "Recorder.hpp"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "Metrics.hpp"
+#include "ThreadPolicy.hpp"
+#include "util/debug.h"
+
+#define INDEX_VERSION 1
+#define INDEX_ENTRY_SIZE 24
+
+static int
+write_fully(int fd, const struct iovec* iov, int count) {
+  struct iovec vec[4];
+  size_t remaining = 0;
+
+  for (int i = 0; i < count; ++i) {
+    vec[i] = iov[i];
+    remaining += iov[i].iov_len;
+  }
+
+  struct iovec* cur = vec;
+  while (remaining > 0) {
+    ssize_t wrote = writev(fd, cur, count);
+
+    if (wrote < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+
+    remaining -= wrote;
+
+    // Skip past whatever was written.
+    while (count > 0 && static_cast<size_t>(wrote) >= cur->iov_len) {
+      wrote -= cur->iov_len;
+      cur += 1;
+      count -= 1;
+    }
+
+    if (count > 0) {
+      cur->iov_base = static_cast<char*>(cur->iov_base) + wrote;
+      cur->iov_len -= wrote;
+    }
+  }
+
+  return 0;
+}
+
+Recorder::Recorder(const std::string& directory, unsigned int segmentSeconds)
+  : mDirectory(directory),
+    mSegmentDuration(static_cast<uint64_t>(segmentSeconds) * 1000000),
+    mStopped(false),
+    mDropped(0),
+    mDataFd(-1),
+    mIndexFd(-1),
+    mSegment(0),
+    mSegmentStart(0),
+    mOffset(0),
+    mUnsynced(0) {
+}
+
+Recorder::~Recorder() {
+  stop();
+}
+
+bool
+Recorder::start(const unsigned char* banner, size_t bannerSize) {
+  if (mkdir(mDirectory.c_str(), 0755) < 0 && errno != EEXIST) {
+    MCERROR("Unable to create recording directory %s", mDirectory.c_str());
+    return false;
+  }
+
+  mBanner.assign(banner, banner + bannerSize);
+  mThread = std::thread(&Recorder::run, this);
+
+  MCINFO("Recording to %s in %d second segments", mDirectory.c_str(),
+    static_cast<int>(mSegmentDuration / 1000000));
+
+  return true;
+}
+
+void
+Recorder::stop() {
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mStopped = true;
+    mCondition.notify_one();
+  }
+
+  if (mThread.joinable()) {
+    mThread.join();
+  }
+}
+
+void
+Recorder::push(const std::shared_ptr<EncodedFrame>& frame) {
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  if (mQueue.size() >= MAX_QUEUED_FRAMES) {
+    gMetrics.framesDropped.add();
+    if (mDropped++ % 100 == 0) {
+      MCWARN("Recorder can't keep up, dropped %ld frames so far", mDropped);
+    }
+    return;
+  }
+
+  mQueue.push_back(frame);
+  mCondition.notify_one();
+}
+
+void
+Recorder::run() {
+  ThreadPolicy::apply(ThreadPolicy::ROLE_IO);
+
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  while (true) {
+    mCondition.wait(lock, [this]{return mStopped || !mQueue.empty();});
+
+    if (mQueue.empty()) {
+      break;
+    }
+
+    std::shared_ptr<EncodedFrame> frame = mQueue.front();
+    mQueue.pop_front();
+
+    lock.unlock();
+    bool ok = write(*frame);
+    frame.reset();
+    lock.lock();
+
+    if (!ok) {
+      MCERROR("Recording failed, stopping recorder");
+      mStopped = true;
+      mQueue.clear();
+      break;
+    }
+  }
+
+  lock.unlock();
+  closeSegment();
+}
+
+bool
+Recorder::write(const EncodedFrame& frame) {
+  uint64_t timestamp = frame.header.timestamp;
+
+  if (mDataFd < 0 || timestamp - mSegmentStart >= mSegmentDuration) {
+    closeSegment();
+    if (!openSegment(timestamp)) {
+      return false;
+    }
+  }
+
+  unsigned char header[4 + FRAME_HEADER_SIZE];
+  putUInt32LE(header, FRAME_HEADER_SIZE + frame.size);
+  frame.header.serialize(header + 4);
+
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = frame.data;
+  iov[1].iov_len = frame.size;
+
+  if (write_fully(mDataFd, iov, 2) < 0) {
+    MCERROR("Unable to write frame to segment %d", mSegment);
+    return false;
+  }
+
+  unsigned char entry[INDEX_ENTRY_SIZE];
+  putUInt32LE(entry, static_cast<uint32_t>(mOffset));
+  putUInt32LE(entry + 4, static_cast<uint32_t>(mOffset >> 32));
+  putUInt32LE(entry + 8, static_cast<uint32_t>(timestamp));
+  putUInt32LE(entry + 12, static_cast<uint32_t>(timestamp >> 32));
+  putUInt32LE(entry + 16, sizeof(header) + frame.size);
+  putUInt32LE(entry + 20, frame.header.sequence);
+  mPendingIndex.insert(mPendingIndex.end(), entry, entry + sizeof(entry));
+
+  mOffset += sizeof(header) + frame.size;
+
+  if (++mUnsynced >= SYNC_EVERY_FRAMES) {
+    sync();
+  }
+
+  return true;
+}
+
+bool
+Recorder::openSegment(uint64_t timestamp) {
+  char path[PATH_MAX];
+
+  snprintf(path, sizeof(path), "%s/segment-%06u.dat", mDirectory.c_str(), mSegment);
+  mDataFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (mDataFd < 0) {
+    MCERROR("Unable to open %s", path);
+    return false;
+  }
+
+  snprintf(path, sizeof(path), "%s/segment-%06u.idx", mDirectory.c_str(), mSegment);
+  mIndexFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (mIndexFd < 0) {
+    MCERROR("Unable to open %s", path);
+    ::close(mDataFd);
+    mDataFd = -1;
+    return false;
+  }
+
+  unsigned char magic[8] = {'M', 'C', 'I', 'X'};
+  putUInt32LE(magic + 4, INDEX_VERSION);
+  mPendingIndex.assign(magic, magic + sizeof(magic));
+
+  struct iovec iov[1];
+  iov[0].iov_base = &mBanner[0];
+  iov[0].iov_len = mBanner.size();
+  if (write_fully(mDataFd, iov, 1) < 0) {
+    MCERROR("Unable to write banner to segment %d", mSegment);
+    return false;
+  }
+
+  mSegmentStart = timestamp;
+  mOffset = mBanner.size();
+
+  return true;
+}
+
+void
+Recorder::closeSegment() {
+  if (mDataFd < 0) {
+    return;
+  }
+
+  sync();
+
+  ::close(mDataFd);
+  ::close(mIndexFd);
+  mDataFd = -1;
+  mIndexFd = -1;
+  mSegment += 1;
+}
+
+void
+Recorder::sync() {
+  // Data first, so that the index never refers to frames that were lost.
+  fdatasync(mDataFd);
+
+  if (!mPendingIndex.empty()) {
+    struct iovec iov[1];
+    iov[0].iov_base = &mPendingIndex[0];
+    iov[0].iov_len = mPendingIndex.size();
+    if (write_fully(mIndexFd, iov, 1) < 0) {
+      MCERROR("Unable to write index of segment %d", mSegment);
+    }
+    mPendingIndex.clear();
+  }
+
+  fdatasync(mIndexFd);
+  mUnsynced = 0;
+}
@@ -0,0 +1,83 @@
+#ifndef MINICAP_RECORDER_HPP
+#define MINICAP_RECORDER_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FramePool.hpp"
+
+// Writes the encoded stream to disk from its own thread, split into
+// segments of a fixed duration:
+//
+//   segment-000000.dat  the stream banner followed by frames exactly as
+//                       sent with -H: u32 length, FrameHeader, payload.
+//   segment-000000.idx  "MCIX", u32 version, then one entry per frame:
+//                       u64 offset into .dat, u64 timestamp, u32 length,
+//                       u32 sequence (all little endian).
+//
+// Both files are append-only. Each frame costs one sequential write; index
+// entries are batched and both files are synced together periodically, so
+// an index entry never points at data that hasn't hit the disk yet.
+class Recorder {
+public:
+  Recorder(const std::string& directory, unsigned int segmentSeconds);
+
+  ~Recorder();
+
+  bool
+  start(const unsigned char* banner, size_t bannerSize);
+
+  void
+  stop();
+
+  // Queues a frame for writing without ever blocking the caller. If the
+  // disk can't keep up the frame is dropped.
+  void
+  push(const std::shared_ptr<EncodedFrame>& frame);
+
+private:
+  static const size_t MAX_QUEUED_FRAMES = 30;
+  static const unsigned int SYNC_EVERY_FRAMES = 30;
+
+  std::string mDirectory;
+  uint64_t mSegmentDuration;
+  std::vector<unsigned char> mBanner;
+
+  std::thread mThread;
+  std::mutex mMutex;
+  std::condition_variable mCondition;
+  std::deque<std::shared_ptr<EncodedFrame>> mQueue;
+  bool mStopped;
+  unsigned long mDropped;
+
+  // Only touched by the writer thread.
+  int mDataFd;
+  int mIndexFd;
+  unsigned int mSegment;
+  uint64_t mSegmentStart;
+  uint64_t mOffset;
+  unsigned int mUnsynced;
+  std::vector<unsigned char> mPendingIndex;
+
+  void
+  run();
+
+  bool
+  write(const EncodedFrame& frame);
+
+  bool
+  openSegment(uint64_t timestamp);
+
+  void
+  closeSegment();
+
+  void
+  sync();
+};
+
+#endif
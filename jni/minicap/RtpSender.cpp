@@ -0,0 +1,249 @@
+#include "RtpSender.hpp"
+
+#include <errno.h>
+#include <netdb.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "Metrics.hpp"
+#include "ThreadPolicy.hpp"
+#include "util/debug.h"
+
+// Leaves room for IP and UDP headers, and some tunneling, in a 1500 byte
+// Ethernet or Wi-Fi MTU.
+#define RTP_PACKET_SIZE 1400
+#define RTP_HEADER_SIZE 12
+#define FRAGMENT_HEADER_SIZE 8
+#define RTP_PAYLOAD_TYPE 96
+
+// Up to this much ahead of schedule a packet still goes out right away,
+// since sleeping any shorter isn't reliable anyway.
+#define PACING_SLACK_US 1000
+
+static inline void
+put_uint16_be(unsigned char* out, uint16_t value) {
+  out[0] = value >> 8;
+  out[1] = value;
+}
+
+static inline void
+put_uint32_be(unsigned char* out, uint32_t value) {
+  out[0] = value >> 24;
+  out[1] = value >> 16;
+  out[2] = value >> 8;
+  out[3] = value;
+}
+
+RtpSender::RtpSender(const std::string& host, const std::string& port, unsigned int kbps)
+  : mHost(host),
+    mPort(port),
+    mKbps(kbps),
+    mFd(-1),
+    mStopped(false),
+    mDropped(0),
+    mFailed(0),
+    mSequence(0),
+    mSsrc(0),
+    mFrameId(0) {
+}
+
+RtpSender::~RtpSender() {
+  stop();
+
+  if (mFd >= 0) {
+    close(mFd);
+  }
+}
+
+bool
+RtpSender::start() {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+
+  struct addrinfo* addresses;
+  int err = getaddrinfo(mHost.c_str(), mPort.c_str(), &hints, &addresses);
+  if (err != 0) {
+    MCERROR("Unable to resolve %s:%s: %s", mHost.c_str(), mPort.c_str(), gai_strerror(err));
+    return false;
+  }
+
+  for (struct addrinfo* address = addresses; address != NULL; address = address->ai_next) {
+    mFd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (mFd < 0) {
+      continue;
+    }
+
+    if (connect(mFd, address->ai_addr, address->ai_addrlen) == 0) {
+      break;
+    }
+
+    close(mFd);
+    mFd = -1;
+  }
+
+  freeaddrinfo(addresses);
+
+  if (mFd < 0) {
+    MCERROR("Unable to open a UDP socket to %s:%s", mHost.c_str(), mPort.c_str());
+    return false;
+  }
+
+  // Tells streams apart when the sender restarts.
+  mSsrc = static_cast<uint32_t>(
+    std::chrono::steady_clock::now().time_since_epoch().count() * 2654435761u) ^ getpid();
+  mNextSend = std::chrono::steady_clock::now();
+  mThread = std::thread(&RtpSender::run, this);
+
+  MCINFO("Sending UDP to %s:%s at %u kbit/s", mHost.c_str(), mPort.c_str(), mKbps);
+
+  return true;
+}
+
+void
+RtpSender::stop() {
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mStopped = true;
+    mCondition.notify_one();
+  }
+
+  if (mThread.joinable()) {
+    mThread.join();
+  }
+}
+
+void
+RtpSender::push(const std::shared_ptr<EncodedFrame>& frame) {
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  // Late frames are worth less than new ones.
+  if (mQueue.size() >= MAX_QUEUED_FRAMES) {
+    mQueue.pop_front();
+    gMetrics.framesDropped.add();
+    if (mDropped++ % 100 == 0) {
+      MCWARN("UDP link can't keep up, dropped %ld frames so far", mDropped);
+    }
+  }
+
+  mQueue.push_back(frame);
+  mCondition.notify_one();
+}
+
+void
+RtpSender::run() {
+  ThreadPolicy::apply(ThreadPolicy::ROLE_STREAM);
+
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  while (true) {
+    mCondition.wait(lock, [this]{return mStopped || !mQueue.empty();});
+
+    if (mStopped) {
+      break;
+    }
+
+    std::shared_ptr<EncodedFrame> frame = mQueue.front();
+    mQueue.pop_front();
+
+    lock.unlock();
+    send(*frame);
+    frame.reset();
+    lock.lock();
+  }
+
+  mQueue.clear();
+}
+
+void
+RtpSender::send(const EncodedFrame& frame) {
+  unsigned char header[FRAME_HEADER_SIZE];
+  frame.header.serialize(header);
+
+  size_t total = FRAME_HEADER_SIZE + frame.size;
+  size_t room = RTP_PACKET_SIZE - RTP_HEADER_SIZE - FRAGMENT_HEADER_SIZE;
+  size_t count = (total + room - 1) / room;
+
+  if (count > 0xFFFF) {
+    MCWARN("Frame of %ld bytes is too big to send over UDP", (long) total);
+    return;
+  }
+
+  uint32_t frameId = mFrameId++;
+  uint32_t timestamp = static_cast<uint32_t>(frame.header.timestamp * 9 / 100);
+  size_t offset = 0;
+
+  for (size_t i = 0; i < count; ++i) {
+    unsigned char head[RTP_HEADER_SIZE + FRAGMENT_HEADER_SIZE];
+    bool last = i + 1 == count;
+
+    head[0] = 0x80;
+    head[1] = (last ? 0x80 : 0) | RTP_PAYLOAD_TYPE;
+    put_uint16_be(head + 2, mSequence++);
+    put_uint32_be(head + 4, timestamp);
+    put_uint32_be(head + 8, mSsrc);
+    put_uint32_be(head + 12, frameId);
+    put_uint16_be(head + 16, i);
+    put_uint16_be(head + 18, count);
+
+    // The data may straddle the frame header and the payload.
+    struct iovec iov[3];
+    int vectors = 1;
+    size_t size = std::min(room, total - offset);
+    size_t end = offset + size;
+
+    iov[0].iov_base = head;
+    iov[0].iov_len = sizeof(head);
+
+    if (offset < FRAME_HEADER_SIZE) {
+      iov[vectors].iov_base = header + offset;
+      iov[vectors].iov_len = std::min<size_t>(end, FRAME_HEADER_SIZE) - offset;
+      vectors += 1;
+    }
+
+    if (end > FRAME_HEADER_SIZE) {
+      size_t start = std::max<size_t>(offset, FRAME_HEADER_SIZE) - FRAME_HEADER_SIZE;
+      iov[vectors].iov_base = frame.data + start;
+      iov[vectors].iov_len = end - FRAME_HEADER_SIZE - start;
+      vectors += 1;
+    }
+
+    pace(sizeof(head) + size);
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = vectors;
+
+    // Nobody listening shows up as ECONNREFUSED on loopback, which is no
+    // reason to stop. Whatever is lost is lost.
+    if (sendmsg(mFd, &msg, MSG_NOSIGNAL) < 0 && errno != ECONNREFUSED &&
+        mFailed++ % 1000 == 0) {
+      MCWARN("Unable to send UDP packet: %s (%ld so far)", strerror(errno), mFailed);
+    }
+
+    gMetrics.packetsSent.add();
+    offset = end;
+  }
+}
+
+void
+RtpSender::pace(size_t size) {
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+  // Idle time doesn't turn into a burst later.
+  if (mNextSend < now) {
+    mNextSend = now;
+  }
+
+  if (mNextSend - now > std::chrono::microseconds(PACING_SLACK_US)) {
+    std::this_thread::sleep_until(mNextSend);
+  }
+
+  mNextSend += std::chrono::microseconds(static_cast<uint64_t>(size) * 8000 / mKbps);
+}
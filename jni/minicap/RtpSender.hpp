@@ -0,0 +1,86 @@
+#ifndef MINICAP_RTP_SENDER_HPP
+#define MINICAP_RTP_SENDER_HPP
+
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "FramePool.hpp"
+
+// Sends the encoded stream over UDP (-U) from its own thread, so that a
+// lost packet costs the frame it belongs to rather than stalling the ones
+// after it like TCP would. There's no retransmission; the receiver drops
+// frames it didn't get all of. See example/rtp-receiver.js.
+//
+// Every frame is sent as it would be with -H, minus the length: the
+// FrameHeader, then the payload. It's split over packets of at most
+// 1400 bytes so as not to get fragmented, each of them:
+//
+//   RTP header   12 bytes, RFC 3550: version 2, payload type 96, the
+//                marker bit set on the last packet of a frame, a sequence
+//                number, a 90 kHz timestamp and a random SSRC.
+//   frame id     u32, counting frames sent
+//   fragment     u16, index of this packet within the frame
+//   fragments    u16, number of packets in the frame
+//   data         the next part of the frame
+//
+// All big endian, like RTP itself (the FrameHeader stays little endian).
+// Packets go out paced at the given rate rather than in one burst per
+// frame, which would overflow shallow router and Wi-Fi queues.
+class RtpSender {
+public:
+  RtpSender(const std::string& host, const std::string& port, unsigned int kbps);
+
+  ~RtpSender();
+
+  bool
+  start();
+
+  void
+  stop();
+
+  // Queues a frame for sending without ever blocking the caller. If the
+  // link can't keep up, the oldest queued frame makes room.
+  void
+  push(const std::shared_ptr<EncodedFrame>& frame);
+
+private:
+  static const size_t MAX_QUEUED_FRAMES = 2;
+
+  std::string mHost;
+  std::string mPort;
+  unsigned int mKbps;
+  int mFd;
+
+  std::thread mThread;
+  std::mutex mMutex;
+  std::condition_variable mCondition;
+  std::deque<std::shared_ptr<EncodedFrame>> mQueue;
+  bool mStopped;
+  unsigned long mDropped;
+
+  // Only touched by the sender thread.
+  unsigned long mFailed;
+  uint16_t mSequence;
+  uint32_t mSsrc;
+  uint32_t mFrameId;
+  std::chrono::steady_clock::time_point mNextSend;
+
+  void
+  run();
+
+  void
+  send(const EncodedFrame& frame);
+
+  // Waits until the next packet may go out, then books its airtime.
+  void
+  pace(size_t size);
+};
+
+#endif
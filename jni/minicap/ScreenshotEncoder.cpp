@@ -0,0 +1,179 @@
+#include "ScreenshotEncoder.hpp"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "Protocol.hpp"
+#include "util/debug.h"
+
+ScreenshotEncoder::ScreenshotEncoder(Format format, unsigned int quality, YUVEncoder& yuv)
+  : mFormat(format),
+    mQuality(quality),
+    mYuv(yuv),
+    mPool(NULL),
+    mPng(NULL),
+    mJpg(NULL),
+    mData(NULL),
+    mSize(0),
+    mWidth(0),
+    mHeight(0) {
+  switch (mFormat) {
+  case FORMAT_PNG:
+    mPool = new WorkerPool();
+    mPng = new PngEncoder(mPool);
+    break;
+  case FORMAT_JPG:
+    mJpg = new JpgEncoder(0, 0, TJSAMP_420, 1);
+    break;
+  default:
+    break;
+  }
+}
+
+ScreenshotEncoder::~ScreenshotEncoder() {
+  delete mPng;
+  delete mPool;
+  delete mJpg;
+}
+
+bool
+ScreenshotEncoder::parseFormat(Format& format, const char* value) {
+  if (strcmp(value, "yuv") == 0) {
+    format = FORMAT_YUV;
+    return true;
+  }
+
+  if (strcmp(value, "png") == 0) {
+    format = FORMAT_PNG;
+    return true;
+  }
+
+  if (strcmp(value, "jpg") == 0 || strcmp(value, "jpeg") == 0) {
+    format = FORMAT_JPG;
+    return true;
+  }
+
+  return false;
+}
+
+bool
+ScreenshotEncoder::encode(Minicap::Frame* frame, const Crop& crop) {
+  // The YUV encoder has already been told about the crop.
+  if (mFormat == FORMAT_YUV) {
+    if (!mYuv.fitFrame(frame->width, frame->height) || !mYuv.encode(frame)) {
+      return false;
+    }
+
+    mData = mYuv.getEncodedData();
+    mSize = mYuv.getEncodedSize();
+    mWidth = mYuv.nvFrame.width;
+    mHeight = mYuv.nvFrame.height;
+    return true;
+  }
+
+  // Anything else reads the region in place through an adjusted view.
+  Minicap::Frame view = *frame;
+
+  if (crop.active()) {
+    uint32_t x = std::min(crop.x, frame->width - 1);
+    uint32_t y = std::min(crop.y, frame->height - 1);
+
+    view.data = static_cast<const unsigned char*>(frame->data)
+      + (y * frame->stride + x) * frame->bpp;
+    view.width = std::min(crop.width, frame->width - x);
+    view.height = std::min(crop.height, frame->height - y);
+  }
+
+  if (view.format == Minicap::FORMAT_RGB_565) {
+    widen(view);
+  }
+
+  mWidth = view.width;
+  mHeight = view.height;
+
+  if (mFormat == FORMAT_PNG) {
+    if (!mPng->encode(&view)) {
+      return false;
+    }
+
+    mData = mPng->getEncodedData();
+    mSize = mPng->getEncodedSize();
+    return true;
+  }
+
+  if (!mJpg->reserveData(view.width, view.height)) {
+    MCERROR("Unable to reserve data for JPG encoder");
+    return false;
+  }
+
+  if (!mJpg->encode(&view, mQuality)) {
+    return false;
+  }
+
+  mData = mJpg->getEncodedData();
+  mSize = mJpg->getEncodedSize();
+  return true;
+}
+
+void
+ScreenshotEncoder::widen(Minicap::Frame& view) {
+  const uint8* source = static_cast<const uint8*>(view.data);
+  size_t sourceStride = static_cast<size_t>(view.stride) * view.bpp;
+  size_t rowSize = static_cast<size_t>(view.width) * 3;
+
+  mWidened.resize(rowSize * view.height);
+  mRow.resize(static_cast<size_t>(view.width) * 4);
+
+  // libyuv only widens to BGRA, which is then packed into RGB. One row at
+  // a time stays in cache.
+  for (uint32_t y = 0; y < view.height; ++y) {
+    RGB565ToARGB(source + y * sourceStride, sourceStride, &mRow[0], mRow.size(), view.width, 1);
+    ARGBToRAW(&mRow[0], mRow.size(), &mWidened[y * rowSize], rowSize, view.width, 1);
+  }
+
+  view.data = &mWidened[0];
+  view.format = Minicap::FORMAT_RGB_888;
+  view.stride = view.width;
+  view.bpp = 3;
+  view.size = mWidened.size();
+}
+
+int
+ScreenshotEncoder::getEncodedSize() {
+  return mSize;
+}
+
+unsigned char*
+ScreenshotEncoder::getEncodedData() {
+  return mData;
+}
+
+uint8_t
+ScreenshotEncoder::getFrameFormat() {
+  switch (mFormat) {
+  case FORMAT_PNG:
+    return FRAME_FORMAT_PNG;
+  case FORMAT_JPG:
+    return FRAME_FORMAT_JPG;
+  default:
+    switch (mYuv.fourcc) {
+    case FOURCC_I420:
+      return FRAME_FORMAT_I420;
+    case FOURCC_I400:
+      return FRAME_FORMAT_GRAY;
+    default:
+      return FRAME_FORMAT_NV12;
+    }
+  }
+}
+
+uint32_t
+ScreenshotEncoder::getWidth() {
+  return mWidth;
+}
+
+uint32_t
+ScreenshotEncoder::getHeight() {
+  return mHeight;
+}
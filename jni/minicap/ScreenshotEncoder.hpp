@@ -0,0 +1,66 @@
+#ifndef MINICAP_SCREENSHOT_ENCODER_HPP
+#define MINICAP_SCREENSHOT_ENCODER_HPP
+
+#include <vector>
+
+#include "JpgEncoder.hpp"
+#include "PngEncoder.hpp"
+#include "WorkerPool.hpp"
+
+// Encodes single frames for -s. Raw YUV goes through the stream encoder,
+// PNG and JPG are encoded straight from the captured buffer.
+class ScreenshotEncoder {
+public:
+  enum Format {
+    FORMAT_YUV  = 0,
+    FORMAT_PNG  = 1,
+    FORMAT_JPG  = 2,
+  };
+
+  ScreenshotEncoder(Format format, unsigned int quality, YUVEncoder& yuv);
+
+  ~ScreenshotEncoder();
+
+  static bool
+  parseFormat(Format& format, const char* value);
+
+  bool
+  encode(Minicap::Frame* frame, const Crop& crop);
+
+  int
+  getEncodedSize();
+
+  unsigned char*
+  getEncodedData();
+
+  // FRAME_FORMAT_* of the encoded data.
+  uint8_t
+  getFrameFormat();
+
+  uint32_t
+  getWidth();
+
+  uint32_t
+  getHeight();
+
+private:
+  Format mFormat;
+  unsigned int mQuality;
+  YUVEncoder& mYuv;
+  WorkerPool* mPool;
+  PngEncoder* mPng;
+  JpgEncoder* mJpg;
+  unsigned char* mData;
+  int mSize;
+  uint32_t mWidth;
+  uint32_t mHeight;
+  // RGB_565 frames widened to RGB_888, which both encoders take.
+  std::vector<unsigned char> mWidened;
+  std::vector<unsigned char> mRow;
+
+  // Points view at a widened copy of its pixels.
+  void
+  widen(Minicap::Frame& view);
+};
+
+#endif
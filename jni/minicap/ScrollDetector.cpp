@@ -0,0 +1,343 @@
+#include "ScrollDetector.hpp"
+
+#include <string.h>
+
+#include <unordered_map>
+
+#include "Metrics.hpp"
+#include "Protocol.hpp"
+#include "util/debug.h"
+
+// A shift has to be backed by at least this many distinctive rows (and
+// 1/16th of the frame) before we trust it.
+#define MIN_VOTES 4
+
+#define HASH_SEED 0xCBF29CE484222325ULL
+#define HASH_PRIME 0x100000001B3ULL
+
+static inline uint64_t
+mix(uint64_t hash, uint64_t value) {
+  hash = (hash ^ value) * HASH_PRIME;
+  return hash ^ (hash >> 29);
+}
+
+static uint64_t
+hash_bytes(uint64_t hash, const unsigned char* data, size_t length) {
+  size_t i = 0;
+
+  for (; i + 8 <= length; i += 8) {
+    uint64_t value;
+    memcpy(&value, data + i, 8);
+    hash = mix(hash, value);
+  }
+
+  for (; i < length; ++i) {
+    hash = mix(hash, data[i]);
+  }
+
+  return hash;
+}
+
+ScrollDetector::ScrollDetector()
+  : mWidth(0),
+    mHeight(0),
+    mFormat(0),
+    mUnit(1) {
+}
+
+void
+ScrollDetector::reset() {
+  mPrevious.reset();
+}
+
+bool
+ScrollDetector::setLayout(const EncodedFrame& frame) {
+  uint32_t width = frame.header.width;
+  uint32_t height = frame.header.height;
+  size_t lumaSize = static_cast<size_t>(width) * height;
+
+  if (width != mWidth || height != mHeight || frame.header.format != mFormat) {
+    mWidth = width;
+    mHeight = height;
+    mFormat = frame.header.format;
+    mPrevious.reset();
+  }
+
+  mPlanes.clear();
+
+  switch (frame.header.format) {
+  case FRAME_FORMAT_I420:
+    if (frame.size != lumaSize * 3 / 2) {
+      return false;
+    }
+    mUnit = 2;
+    mPlanes.push_back({0, width, width, 2, 2});
+    mPlanes.push_back({lumaSize, width / 2, width / 2, 1, 1});
+    mPlanes.push_back({lumaSize * 5 / 4, width / 2, width / 2, 1, 1});
+    break;
+  case FRAME_FORMAT_NV12:
+    if (frame.size != lumaSize * 3 / 2) {
+      return false;
+    }
+    mUnit = 2;
+    mPlanes.push_back({0, width, width, 2, 2});
+    mPlanes.push_back({lumaSize, width, width, 1, 2});
+    break;
+  case FRAME_FORMAT_GRAY:
+    if (frame.size != lumaSize) {
+      return false;
+    }
+    mUnit = 1;
+    mPlanes.push_back({0, width, width, 1, 1});
+    break;
+  default:
+    return false;
+  }
+
+  return width > 0 && height > 0 && width % mUnit == 0 && height % mUnit == 0;
+}
+
+void
+ScrollDetector::hashRows(const unsigned char* data, std::vector<uint64_t>& hashes) {
+  hashes.resize(mHeight / mUnit);
+
+  for (uint32_t unit = 0; unit < hashes.size(); ++unit) {
+    uint64_t hash = HASH_SEED;
+
+    for (auto& plane: mPlanes) {
+      for (uint32_t i = 0; i < plane.rows; ++i) {
+        const unsigned char* row = data + plane.offset
+          + static_cast<size_t>(unit * plane.rows + i) * plane.stride;
+        hash = hash_bytes(hash, row, plane.width);
+      }
+    }
+
+    hashes[unit] = hash;
+  }
+}
+
+void
+ScrollDetector::hashColumns(const unsigned char* data, uint32_t first, uint32_t last,
+    std::vector<uint64_t>& hashes) {
+  uint32_t units = mWidth / mUnit;
+
+  hashes.assign(units, HASH_SEED);
+
+  // Walking the columns directly would thrash the cache, so every byte
+  // column gets its own running hash, filled row by row.
+  std::vector<uint64_t> columns;
+
+  for (auto& plane: mPlanes) {
+    columns.assign(plane.width, HASH_SEED);
+
+    for (uint32_t y = first * plane.rows; y < last * plane.rows; ++y) {
+      const unsigned char* row = data + plane.offset + static_cast<size_t>(y) * plane.stride;
+
+      for (uint32_t x = 0; x < plane.width; ++x) {
+        columns[x] = (columns[x] + row[x]) * HASH_PRIME;
+      }
+    }
+
+    for (uint32_t unit = 0; unit < units; ++unit) {
+      for (uint32_t i = 0; i < plane.columns; ++i) {
+        hashes[unit] = mix(hashes[unit], columns[unit * plane.columns + i]);
+      }
+    }
+  }
+}
+
+bool
+ScrollDetector::findShift(const std::vector<uint64_t>& previous,
+    const std::vector<uint64_t>& current, Shift& shift) {
+  int32_t count = current.size();
+
+  // Flat rows look the same everywhere, so only rows that are unique in the
+  // previous frame get a vote.
+  std::unordered_map<uint64_t, int32_t> positions;
+  positions.reserve(count);
+
+  for (int32_t i = 0; i < count; ++i) {
+    auto inserted = positions.insert(std::make_pair(previous[i], i));
+    if (!inserted.second) {
+      inserted.first->second = -1;
+    }
+  }
+
+  std::vector<int32_t> votes(count * 2, 0);
+  int32_t best = 0;
+
+  for (int32_t y = 0; y < count; ++y) {
+    auto match = positions.find(current[y]);
+    if (match == positions.end() || match->second < 0 || match->second == y) {
+      continue;
+    }
+
+    int32_t offset = match->second - y;
+    if (++votes[offset + count] > votes[best + count]) {
+      best = offset;
+    }
+  }
+
+  if (best == 0 || votes[best + count] < MIN_VOTES || votes[best + count] < count / 16) {
+    return false;
+  }
+
+  // The longest band that moved by that much.
+  int32_t bandStart = 0, bandEnd = 0;
+
+  for (int32_t y = std::max(0, -best); y < std::min(count, count - best);) {
+    if (current[y] != previous[y + best]) {
+      ++y;
+      continue;
+    }
+
+    int32_t end = y + 1;
+    while (end < count && end + best < count && current[end] == previous[end + best]) {
+      ++end;
+    }
+
+    if (end - y > bandEnd - bandStart) {
+      bandStart = y;
+      bandEnd = end;
+    }
+
+    y = end;
+  }
+
+  // Whatever else changed goes into the strip.
+  int32_t stripStart = count, stripEnd = 0;
+
+  for (int32_t y = 0; y < count; ++y) {
+    if ((y < bandStart || y >= bandEnd) && current[y] != previous[y]) {
+      stripStart = std::min(stripStart, y);
+      stripEnd = y + 1;
+    }
+  }
+
+  if (stripEnd == 0) {
+    stripStart = 0;
+  }
+
+  // Not worth it if most of the frame has to be sent anyway.
+  if (stripEnd - stripStart > count / 2) {
+    return false;
+  }
+
+  shift.offset = best;
+  shift.bandStart = bandStart;
+  shift.bandEnd = bandEnd;
+  shift.stripStart = stripStart;
+  shift.stripEnd = stripEnd;
+
+  return true;
+}
+
+std::shared_ptr<EncodedFrame>
+ScrollDetector::makeFrame(const EncodedFrame& frame, const Shift& shift,
+    bool vertical, FramePool& pool) {
+  uint32_t strip = shift.stripEnd - shift.stripStart;
+  uint32_t extent = shift.extentEnd - shift.extentStart;
+  size_t stripSize = 0;
+
+  for (auto& plane: mPlanes) {
+    stripSize += vertical
+      ? static_cast<size_t>(strip) * plane.rows * plane.width
+      : static_cast<size_t>(strip) * plane.columns * extent * plane.rows;
+  }
+
+  std::shared_ptr<EncodedFrame> shifted = pool.acquire(SHIFT_RECORD_SIZE + stripSize);
+  if (!shifted) {
+    return shifted;
+  }
+
+  unsigned char* out = shifted->data;
+  int32_t offset = -shift.offset * static_cast<int32_t>(mUnit);
+  putUInt32LE(out, vertical ? 0 : offset);
+  putUInt32LE(out + 4, vertical ? offset : 0);
+  putUInt32LE(out + 8, shift.bandStart * mUnit);
+  putUInt32LE(out + 12, shift.bandEnd * mUnit);
+  putUInt32LE(out + 16, shift.stripStart * mUnit);
+  putUInt32LE(out + 20, shift.stripEnd * mUnit);
+  putUInt32LE(out + 24, shift.extentStart * mUnit);
+  putUInt32LE(out + 28, shift.extentEnd * mUnit);
+  out += SHIFT_RECORD_SIZE;
+
+  // The strip is a picture of its own in the stream format.
+  for (auto& plane: mPlanes) {
+    const unsigned char* data = frame.data + plane.offset;
+
+    if (vertical) {
+      size_t size = static_cast<size_t>(strip) * plane.rows * plane.width;
+      memcpy(out, data + static_cast<size_t>(shift.stripStart) * plane.rows * plane.stride, size);
+      out += size;
+    }
+    else {
+      size_t size = static_cast<size_t>(strip) * plane.columns;
+      for (uint32_t y = shift.extentStart * plane.rows; y < shift.extentEnd * plane.rows; ++y) {
+        memcpy(out, data + static_cast<size_t>(y) * plane.stride + shift.stripStart * plane.columns, size);
+        out += size;
+      }
+    }
+  }
+
+  shifted->size = SHIFT_RECORD_SIZE + stripSize;
+  shifted->header = frame.header;
+  shifted->header.type = FRAME_TYPE_SHIFT;
+
+  return shifted;
+}
+
+std::shared_ptr<EncodedFrame>
+ScrollDetector::encode(const std::shared_ptr<EncodedFrame>& frame, FramePool& pool) {
+  std::shared_ptr<EncodedFrame> shifted;
+
+  if (!setLayout(*frame)) {
+    mPrevious.reset();
+    return shifted;
+  }
+
+  hashRows(frame->data, mRows);
+
+  if (mPrevious) {
+    Shift shift;
+    shift.extentStart = 0;
+    shift.extentEnd = mWidth / mUnit;
+
+    if (findShift(mPreviousRows, mRows, shift)) {
+      shifted = makeFrame(*frame, shift, true, pool);
+    }
+    else {
+      // Columns only over the rows that changed, or fixed bars above and
+      // below a pager would make every column differ.
+      uint32_t first = mRows.size(), last = 0;
+
+      for (uint32_t y = 0; y < mRows.size(); ++y) {
+        if (mRows[y] != mPreviousRows[y]) {
+          first = std::min(first, y);
+          last = y + 1;
+        }
+      }
+
+      if (last > first) {
+        hashColumns(mPrevious->data, first, last, mPreviousColumns);
+        hashColumns(frame->data, first, last, mColumns);
+
+        shift.extentStart = first;
+        shift.extentEnd = last;
+
+        if (findShift(mPreviousColumns, mColumns, shift)) {
+          shifted = makeFrame(*frame, shift, false, pool);
+        }
+      }
+    }
+  }
+
+  mRows.swap(mPreviousRows);
+  mPrevious = frame;
+
+  if (shifted) {
+    gMetrics.framesShifted.add();
+  }
+
+  return shifted;
+}
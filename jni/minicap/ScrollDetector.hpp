@@ -0,0 +1,94 @@
+#ifndef MINICAP_SCROLL_DETECTOR_HPP
+#define MINICAP_SCROLL_DETECTOR_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include "FramePool.hpp"
+
+// Recognizes scrolling between consecutive raw frames (-e). Scrolling
+// changes every pixel in the scrolled area, yet all but a thin strip of it
+// is already on the client's screen, just elsewhere.
+//
+// Every row of the picture is hashed, luma and chroma alike. A shift is
+// found by matching the hashes of distinctive rows against the previous
+// frame; the longest band of rows that matches at that offset is then sent
+// as a FRAME_TYPE_SHIFT instruction, along with a strip holding all other
+// rows that changed. Failing that, the same is tried with columns, limited
+// to the rows that changed so that fixed toolbars don't get in the way.
+// Shifts are in whole chroma rows, so subsampled formats only move by even
+// offsets.
+class ScrollDetector {
+public:
+  ScrollDetector();
+
+  // Compares the frame with the previous one given and returns a shift
+  // frame describing it, or an empty pointer if a full frame should be
+  // sent. The frame then becomes the previous one either way, and is held
+  // on to until the next call.
+  std::shared_ptr<EncodedFrame>
+  encode(const std::shared_ptr<EncodedFrame>& frame, FramePool& pool);
+
+  // Forgets the previous frame.
+  void
+  reset();
+
+private:
+  struct Plane {
+    size_t offset;
+    uint32_t stride;
+    // Bytes per row and rows per unit in this plane.
+    uint32_t width;
+    uint32_t rows;
+    // Bytes per unit horizontally.
+    uint32_t columns;
+  };
+
+  struct Shift {
+    int32_t offset;
+    uint32_t bandStart;
+    uint32_t bandEnd;
+    uint32_t stripStart;
+    uint32_t stripEnd;
+    // Along the other axis.
+    uint32_t extentStart;
+    uint32_t extentEnd;
+  };
+
+  uint32_t mWidth;
+  uint32_t mHeight;
+  uint8_t mFormat;
+  // Pixels per unit along each axis.
+  uint32_t mUnit;
+  std::vector<Plane> mPlanes;
+
+  std::shared_ptr<EncodedFrame> mPrevious;
+  std::vector<uint64_t> mRows;
+  std::vector<uint64_t> mPreviousRows;
+  std::vector<uint64_t> mColumns;
+  std::vector<uint64_t> mPreviousColumns;
+
+  bool
+  setLayout(const EncodedFrame& frame);
+
+  void
+  hashRows(const unsigned char* data, std::vector<uint64_t>& hashes);
+
+  // Only rows in [first, last) (in units) count.
+  void
+  hashColumns(const unsigned char* data, uint32_t first, uint32_t last,
+    std::vector<uint64_t>& hashes);
+
+  static bool
+  findShift(const std::vector<uint64_t>& previous,
+    const std::vector<uint64_t>& current, Shift& shift);
+
+  std::shared_ptr<EncodedFrame>
+  makeFrame(const EncodedFrame& frame, const Shift& shift, bool vertical,
+    FramePool& pool);
+};
+
+#endif
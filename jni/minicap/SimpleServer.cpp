@@ -12,6 +12,7 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 SimpleServer::SimpleServer(): mFd(0) {
 }
 
@@ -22,7 +23,7 @@ SimpleServer::~SimpleServer() {
 }
 
 int
-SimpleServer::start(const char* sockname) {
+SimpleServer::start(const char* sockname, int port) {
 int sfd = socket(AF_INET, SOCK_STREAM, 0);
 	if (sfd < 0){
 		return sfd;
@@ -43,7 +44,7 @@ int sfd = socket(AF_INET, SOCK_STREAM, 0);
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;//协议
 	addr.sin_addr.s_addr = htonl(INADDR_ANY);//IP地址
-	addr.sin_port = htons(9999);//端口号
+	addr.sin_port = htons(port);//端口号
 
 	int reuseaddr = 1;
 	if (::setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof(reuseaddr)) < 0) {
@@ -74,3 +75,16 @@ SimpleServer::accept() {
   socklen_t addr_len = sizeof(addr);
   return ::accept(mFd, (struct sockaddr *) &addr, &addr_len);
 }
+
+int
+SimpleServer::accept(int timeout) {
+  struct pollfd pfd;
+  pfd.fd = mFd;
+  pfd.events = POLLIN;
+
+  if (poll(&pfd, 1, timeout) <= 0) {
+    return -1;
+  }
+
+  return accept();
+}
@@ -7,10 +7,15 @@ public:
   ~SimpleServer();
 
   int
-  start(const char* sockname);
+  start(const char* sockname, int port = 9999);
 
   int accept();
 
+  // Waits at most timeout milliseconds for a client, -1 being forever.
+  // Returns -1 if nobody showed up.
+  int
+  accept(int timeout);
+
 private:
   int mFd;
 };
@@ -0,0 +1,136 @@
+#include "Simulcast.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/debug.h"
+
+static YuvFrame
+i420_frame(unsigned char* data, int width, int height) {
+  YuvFrame frame;
+  frame.width = width;
+  frame.height = height;
+  frame.size = width * height * 3 / 2;
+  frame.data = data;
+  frame.y = data;
+  frame.u = frame.y + width * height;
+  frame.v = frame.u + width * height / 4;
+  return frame;
+}
+
+Simulcast::Simulcast(uint32 fourcc, const std::vector<float>& scales)
+  : mFourcc(fourcc) {
+  for (float scale: scales) {
+    Level level;
+    level.scale = scale;
+    level.width = 0;
+    level.height = 0;
+    mLevels.push_back(level);
+  }
+}
+
+bool
+Simulcast::parseScales(std::vector<float>& scales, const char* value) {
+  std::vector<float> parsed;
+  parsed.push_back(1);
+
+  const char* cursor = value;
+  while (*cursor != '\0') {
+    char* end;
+    float scale = strtof(cursor, &end);
+
+    if (end == cursor || scale <= 0 || scale > parsed.back() ||
+        (scale == parsed.back() && scale != 1)) {
+      return false;
+    }
+
+    if (scale < 1) {
+      parsed.push_back(scale);
+    }
+
+    if (*end != ',' && *end != '\0') {
+      return false;
+    }
+
+    cursor = *end == ',' ? end + 1 : end;
+  }
+
+  scales = parsed;
+  return true;
+}
+
+bool
+Simulcast::encode(const YuvFrame& base, unsigned int last, FramePool& pool,
+    std::vector<std::shared_ptr<EncodedFrame>>& frames) {
+  YuvFrame source = base;
+
+  frames.resize(mLevels.size());
+
+  for (unsigned int i = 1; i <= last && i < mLevels.size(); ++i) {
+    Level& level = mLevels[i];
+
+    int width = static_cast<int>(base.width * level.scale + 0.5f) & ~1;
+    int height = static_cast<int>(base.height * level.scale + 0.5f) & ~1;
+
+    if (width < 2 || height < 2) {
+      MCERROR("Rendition %d would be empty", i);
+      return false;
+    }
+
+    if (width != level.width || height != level.height) {
+      MCINFO("Rendition %d is %dx%d", i, width, height);
+      level.width = width;
+      level.height = height;
+      level.i420.resize(mFourcc == FOURCC_NV12 ? width * height * 3 / 2 : 0);
+    }
+
+    std::shared_ptr<EncodedFrame> encoded = pool.acquire(width * height * 3 / 2);
+    if (!encoded) {
+      return false;
+    }
+
+    // Planar formats are scaled right into the output.
+    YuvFrame target = i420_frame(
+      mFourcc == FOURCC_NV12 ? level.i420.data() : encoded->data, width, height);
+
+    // Box filtering costs little at these ratios and keeps thumbnails from
+    // shimmering.
+    if (mFourcc == FOURCC_I400) {
+      ScalePlane(source.y, source.width, source.width, source.height,
+        target.y, target.width, target.width, target.height,
+        kFilterBox);
+      target.size = width * height;
+    }
+    else if (I420Scale(source.y, source.width,
+          source.u, source.width / 2,
+          source.v, source.width / 2,
+          source.width, source.height,
+          target.y, target.width,
+          target.u, target.width / 2,
+          target.v, target.width / 2,
+          target.width, target.height,
+          kFilterBox) != 0) {
+      return false;
+    }
+
+    if (mFourcc == FOURCC_NV12 && ConvertFromI420(target.y, target.width,
+          target.u, target.width / 2,
+          target.v, target.width / 2,
+          encoded->data, target.width,
+          target.width, target.height,
+          mFourcc) != 0) {
+      return false;
+    }
+
+    encoded->size = target.size;
+    encoded->header = frames[0]->header;
+    encoded->header.rendition = i;
+    encoded->header.width = width;
+    encoded->header.height = height;
+
+    frames[i] = encoded;
+    source = target;
+  }
+
+  return true;
+}
@@ -0,0 +1,62 @@
+#ifndef MINICAP_SIMULCAST_HPP
+#define MINICAP_SIMULCAST_HPP
+
+#include <memory>
+#include <vector>
+
+#include "FramePool.hpp"
+#include "JpgEncoder.hpp"
+
+// Produces smaller renditions of every frame for clients that want them,
+// e.g. live thumbnails next to a full resolution recording. Rendition 0 is
+// the regular encoder output; each further one is scaled down from the one
+// before it rather than from the source, so every step only has to read a
+// fraction of the pixels. Only renditions up to the smallest one somebody
+// subscribed to are produced.
+class Simulcast {
+public:
+  Simulcast(uint32 fourcc, const std::vector<float>& scales);
+
+  // Parses "<scale>[,<scale>...]", each relative to the stream output and
+  // in decreasing order. A leading 1 is implied.
+  static bool
+  parseScales(std::vector<float>& scales, const char* value);
+
+  unsigned int
+  getCount() {
+    return mLevels.size();
+  }
+
+  void
+  setFourcc(uint32 fourcc) {
+    mFourcc = fourcc;
+
+    // Forces the level buffers to be resized.
+    for (auto& level: mLevels) {
+      level.width = 0;
+      level.height = 0;
+    }
+  }
+
+  // Encodes renditions 1 to last from the I420 planes of rendition 0 into
+  // frames[1..last], taken from the pool. Headers are copied from frames[0]
+  // and adjusted.
+  bool
+  encode(const YuvFrame& base, unsigned int last, FramePool& pool,
+    std::vector<std::shared_ptr<EncodedFrame>>& frames);
+
+private:
+  struct Level {
+    float scale;
+    int width;
+    int height;
+    // I420 planes of this level for NV12 output. Planar output formats
+    // use the encoded frame directly.
+    std::vector<unsigned char> i420;
+  };
+
+  uint32 mFourcc;
+  std::vector<Level> mLevels;
+};
+
+#endif
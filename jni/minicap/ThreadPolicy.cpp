@@ -0,0 +1,268 @@
+#include "ThreadPolicy.hpp"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "util/debug.h"
+
+static const char* ROLE_NAMES[] = {"capture", "stream", "workers", "io"};
+
+ThreadPolicy::Policy ThreadPolicy::sPolicies[ThreadPolicy::ROLE_COUNT];
+std::atomic<int> ThreadPolicy::sLastThreads[ThreadPolicy::ROLE_COUNT];
+
+static int
+current_thread() {
+  return syscall(__NR_gettid);
+}
+
+// CPU_COUNT() is missing from older platform headers.
+static int
+count_cpus(const cpu_set_t& cpus) {
+  int count = 0;
+
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    count += CPU_ISSET(cpu, &cpus) ? 1 : 0;
+  }
+
+  return count;
+}
+
+// Reads a single number from a sysfs file, or returns 0.
+static unsigned long
+read_number(const char* path) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL) {
+    return 0;
+  }
+
+  unsigned long value = 0;
+  if (fscanf(file, "%lu", &value) != 1) {
+    value = 0;
+  }
+
+  fclose(file);
+  return value;
+}
+
+// Relative speed of every possible CPU, 0 if unknown.
+static std::vector<unsigned long>
+cpu_speeds() {
+  std::vector<unsigned long> speeds;
+  long count = sysconf(_SC_NPROCESSORS_CONF);
+  char path[128];
+
+  for (long cpu = 0; cpu < count && cpu < CPU_SETSIZE; ++cpu) {
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%ld/cpu_capacity", cpu);
+    unsigned long speed = read_number(path);
+
+    if (speed == 0) {
+      snprintf(path, sizeof(path),
+        "/sys/devices/system/cpu/cpu%ld/cpufreq/cpuinfo_max_freq", cpu);
+      speed = read_number(path);
+    }
+
+    speeds.push_back(speed);
+  }
+
+  return speeds;
+}
+
+bool
+ThreadPolicy::parseClass(cpu_set_t& cpus, const std::string& name) {
+  if (name != "big" && name != "little" && name != "prime" && name != "all") {
+    return false;
+  }
+
+  std::vector<unsigned long> speeds = cpu_speeds();
+  unsigned long slowest = 0, fastest = 0;
+
+  for (auto speed: speeds) {
+    if (speed > 0 && (slowest == 0 || speed < slowest)) {
+      slowest = speed;
+    }
+
+    fastest = std::max(fastest, speed);
+  }
+
+  CPU_ZERO(&cpus);
+
+  for (size_t cpu = 0; cpu < speeds.size(); ++cpu) {
+    unsigned long speed = speeds[cpu];
+    bool symmetric = slowest == fastest;
+    bool member = name == "all" || symmetric ||
+      (name == "big" && speed > slowest) ||
+      (name == "little" && speed == slowest) ||
+      (name == "prime" && speed == fastest);
+
+    if (member) {
+      CPU_SET(cpu, &cpus);
+    }
+  }
+
+  return true;
+}
+
+bool
+ThreadPolicy::parseCpus(cpu_set_t& cpus, const std::string& value) {
+  if (parseClass(cpus, value)) {
+    return count_cpus(cpus) > 0;
+  }
+
+  CPU_ZERO(&cpus);
+
+  // <cpu>[-<cpu>][,...]
+  const char* cursor = value.c_str();
+
+  while (*cursor != '\0') {
+    char* end;
+    long first = strtol(cursor, &end, 10);
+    long last = first;
+
+    if (end == cursor) {
+      return false;
+    }
+
+    if (*end == '-') {
+      cursor = end + 1;
+      last = strtol(cursor, &end, 10);
+      if (end == cursor) {
+        return false;
+      }
+    }
+
+    if (first < 0 || last < first || last >= CPU_SETSIZE) {
+      return false;
+    }
+
+    for (long cpu = first; cpu <= last; ++cpu) {
+      CPU_SET(cpu, &cpus);
+    }
+
+    if (*end == ',') {
+      ++end;
+    }
+    else if (*end != '\0') {
+      return false;
+    }
+
+    cursor = end;
+  }
+
+  return count_cpus(cpus) > 0;
+}
+
+bool
+ThreadPolicy::parse(const char* value) {
+  std::string spec(value);
+  size_t equals = spec.find('=');
+  if (equals == std::string::npos) {
+    return false;
+  }
+
+  std::string name = spec.substr(0, equals);
+  std::string cpus = spec.substr(equals + 1);
+  std::string scheduling;
+
+  size_t colon = cpus.find(':');
+  if (colon != std::string::npos) {
+    scheduling = cpus.substr(colon + 1);
+    cpus = cpus.substr(0, colon);
+  }
+
+  int role = 0;
+  while (role < ROLE_COUNT && name != ROLE_NAMES[role]) {
+    ++role;
+  }
+
+  if (role == ROLE_COUNT) {
+    return false;
+  }
+
+  Policy policy;
+  memset(&policy, 0, sizeof(policy));
+  policy.set = true;
+
+  // Empty keeps the CPUs the thread already had, e.g. "io=:10".
+  if (!cpus.empty()) {
+    if (!parseCpus(policy.cpus, cpus)) {
+      return false;
+    }
+    policy.hasCpus = true;
+  }
+
+  if (scheduling.compare(0, 4, "fifo") == 0) {
+    policy.fifo = true;
+    policy.priority = scheduling.size() > 4 ? atoi(scheduling.c_str() + 4) : 1;
+
+    if (policy.priority < sched_get_priority_min(SCHED_FIFO) ||
+        policy.priority > sched_get_priority_max(SCHED_FIFO)) {
+      return false;
+    }
+  }
+  else if (!scheduling.empty()) {
+    char* end;
+    policy.nice = strtol(scheduling.c_str(), &end, 10);
+    policy.hasNice = true;
+
+    if (*end != '\0' || policy.nice < -20 || policy.nice > 19) {
+      return false;
+    }
+  }
+
+  sPolicies[role] = policy;
+
+  MCINFO("Threads of role %s get %d CPUs (0 for any)%s", ROLE_NAMES[role],
+    policy.hasCpus ? count_cpus(policy.cpus) : 0,
+    policy.fifo ? " and SCHED_FIFO" : policy.hasNice ? " and a nice value" : "");
+
+  return true;
+}
+
+void
+ThreadPolicy::apply(Role role) {
+  const Policy& policy = sPolicies[role];
+  if (!policy.set) {
+    return;
+  }
+
+  int tid = current_thread();
+
+  if (policy.hasCpus && sched_setaffinity(tid, sizeof(policy.cpus), &policy.cpus) < 0) {
+    MCWARN("Unable to set the CPUs of %s thread %d (%s)", ROLE_NAMES[role], tid, strerror(errno));
+  }
+
+  if (policy.fifo) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = policy.priority;
+
+    if (sched_setscheduler(tid, SCHED_FIFO, &param) < 0) {
+      MCWARN("Unable to make %s thread %d SCHED_FIFO (%s)", ROLE_NAMES[role], tid, strerror(errno));
+    }
+  }
+
+  if (policy.hasNice && setpriority(PRIO_PROCESS, tid, policy.nice) < 0) {
+    MCWARN("Unable to renice %s thread %d (%s)", ROLE_NAMES[role], tid, strerror(errno));
+  }
+}
+
+void
+ThreadPolicy::applyOnce(Role role) {
+  if (!sPolicies[role].set) {
+    return;
+  }
+
+  int tid = current_thread();
+
+  if (sLastThreads[role].exchange(tid, std::memory_order_relaxed) != tid) {
+    apply(role);
+  }
+}
@@ -0,0 +1,75 @@
+#ifndef MINICAP_THREAD_POLICY_HPP
+#define MINICAP_THREAD_POLICY_HPP
+
+#include <sched.h>
+
+#include <atomic>
+#include <string>
+
+// Pins the threads of each pipeline role to a set of CPUs and gives them a
+// scheduling policy (-K), so that conversion doesn't get parked on a little
+// core next to the binder thread that feeds it.
+//
+// Roles:
+//
+//   capture  whatever thread reports new frames (the binder callback, or
+//            the prefetching screenshot thread)
+//   stream   the per-display loops, which convert and send, and the UDP
+//            sender (-U)
+//   workers  the worker pool (-c)
+//   io       recordings, metrics and tracing
+//
+// CPUs are given as a list like 0-3,6, or by class: "big" is every core
+// faster than the slowest ones, "little" the slowest ones and "prime" the
+// fastest ones, going by cpu_capacity or else cpuinfo_max_freq in sysfs.
+// On a symmetric system all three are every CPU, as is "all".
+//
+// The policy is either a nice value like -10, or fifo with an optional
+// real-time priority like fifo2. Setting either may need privileges the
+// process doesn't have, in which case it's logged and the CPUs still apply.
+class ThreadPolicy {
+public:
+  enum Role {
+    ROLE_CAPTURE  = 0,
+    ROLE_STREAM   = 1,
+    ROLE_WORKERS  = 2,
+    ROLE_IO       = 3,
+    ROLE_COUNT    = 4,
+  };
+
+  // Parses "<role>=<cpus>[:<policy>]" and makes it the policy for that
+  // role.
+  static bool
+  parse(const char* value);
+
+  // Applies the role's policy, if any, to the calling thread.
+  static void
+  apply(Role role);
+
+  // Like apply(), but only does something if the calling thread is a
+  // different one than last time. For callbacks on threads we don't own.
+  static void
+  applyOnce(Role role);
+
+private:
+  struct Policy {
+    bool set;
+    cpu_set_t cpus;
+    bool hasCpus;
+    bool fifo;
+    int priority;
+    bool hasNice;
+    int nice;
+  };
+
+  static Policy sPolicies[ROLE_COUNT];
+  static std::atomic<int> sLastThreads[ROLE_COUNT];
+
+  static bool
+  parseCpus(cpu_set_t& cpus, const std::string& value);
+
+  static bool
+  parseClass(cpu_set_t& cpus, const std::string& name);
+};
+
+#endif
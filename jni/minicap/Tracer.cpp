@@ -0,0 +1,202 @@
+#include "Tracer.hpp"
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "ThreadPolicy.hpp"
+#include "util/debug.h"
+
+#define COMMAND_DUMP 'd'
+#define COMMAND_QUIT 'q'
+
+Tracer gTracer;
+
+static uint32_t
+current_thread() {
+  return syscall(__NR_gettid);
+}
+
+Tracer::Tracer()
+  : mEnabled(false),
+    mEvents(NULL),
+    mMask(0),
+    mNext(0) {
+  mPipe[0] = mPipe[1] = -1;
+}
+
+Tracer::~Tracer() {
+  stop();
+  delete[] mEvents;
+}
+
+bool
+Tracer::start(const std::string& path, size_t capacity) {
+  // Rounded up so that the slot is a mask away.
+  size_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+
+  if (pipe(mPipe) < 0) {
+    MCERROR("Unable to create trace pipe");
+    return false;
+  }
+
+  mPath = path;
+  mEvents = new Event[size];
+  mMask = size - 1;
+
+  for (size_t i = 0; i < size; ++i) {
+    mEvents[i].sequence.store(0, std::memory_order_relaxed);
+  }
+
+  mThread = std::thread(&Tracer::run, this);
+  mEnabled.store(true, std::memory_order_release);
+
+  MCINFO("Tracing the last %ld events to %s", (long) size, path.c_str());
+
+  return true;
+}
+
+void
+Tracer::stop() {
+  if (!mThread.joinable()) {
+    return;
+  }
+
+  char command = COMMAND_QUIT;
+  if (write(mPipe[1], &command, 1) == 1) {
+    mThread.join();
+  }
+  else {
+    mThread.detach();
+  }
+
+  dump();
+  mEnabled.store(false, std::memory_order_relaxed);
+
+  close(mPipe[0]);
+  close(mPipe[1]);
+  mPipe[0] = mPipe[1] = -1;
+}
+
+void
+Tracer::requestDump() {
+  // Only async-signal-safe calls here.
+  if (mPipe[1] >= 0) {
+    char command = COMMAND_DUMP;
+    int saved = errno;
+    ssize_t ignored = write(mPipe[1], &command, 1);
+    (void) ignored;
+    errno = saved;
+  }
+}
+
+void
+Tracer::record(const char* name, char phase, uint32_t frame, uint64_t timestamp,
+    uint64_t duration) {
+  uint64_t index = mNext.fetch_add(1, std::memory_order_relaxed);
+  Event& event = mEvents[index & mMask];
+
+  // Readers ignore the slot until the sequence is back.
+  event.sequence.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  event.name = name;
+  event.phase = phase;
+  event.thread = current_thread();
+  event.frame = frame;
+  event.timestamp = timestamp;
+  event.duration = duration;
+
+  event.sequence.store(index + 1, std::memory_order_release);
+}
+
+bool
+Tracer::dump() {
+  if (mEvents == NULL) {
+    return false;
+  }
+
+  std::string temporary = mPath + ".tmp";
+  FILE* out = fopen(temporary.c_str(), "w");
+  if (out == NULL) {
+    MCERROR("Unable to open %s", temporary.c_str());
+    return false;
+  }
+
+  uint64_t end = mNext.load(std::memory_order_acquire);
+  uint64_t begin = end > mMask + 1 ? end - mMask - 1 : 0;
+  int pid = getpid();
+  int count = 0;
+
+  fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+    "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"minicap\"}}",
+    pid);
+
+  for (uint64_t index = begin; index < end; ++index) {
+    Event& slot = mEvents[index & mMask];
+
+    uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+    const char* name = slot.name;
+    char phase = slot.phase;
+    uint32_t thread = slot.thread;
+    uint32_t frame = slot.frame;
+    uint64_t timestamp = slot.timestamp;
+    uint64_t duration = slot.duration;
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    // Still being written, or already overwritten by a newer event.
+    if (sequence != index + 1 ||
+        slot.sequence.load(std::memory_order_relaxed) != sequence) {
+      continue;
+    }
+
+    fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"minicap\",\"ph\":\"%c\",\"pid\":%d,"
+      "\"tid\":%u,\"ts\":%llu", name, phase, pid, thread, (unsigned long long) timestamp);
+
+    if (phase == 'X') {
+      fprintf(out, ",\"dur\":%llu", (unsigned long long) duration);
+    }
+    else {
+      fprintf(out, ",\"s\":\"t\"");
+    }
+
+    fprintf(out, ",\"args\":{\"frame\":%u}}", frame);
+    ++count;
+  }
+
+  fprintf(out, "\n]}\n");
+
+  if (fclose(out) != 0 || rename(temporary.c_str(), mPath.c_str()) < 0) {
+    MCERROR("Unable to write trace to %s", mPath.c_str());
+    return false;
+  }
+
+  MCINFO("Wrote %d trace events to %s", count, mPath.c_str());
+
+  return true;
+}
+
+void
+Tracer::run() {
+  ThreadPolicy::apply(ThreadPolicy::ROLE_IO);
+
+  char command;
+
+  while (true) {
+    ssize_t n = read(mPipe[0], &command, 1);
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0 || command == COMMAND_QUIT) {
+      return;
+    }
+
+    dump();
+  }
+}
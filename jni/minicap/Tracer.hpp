@@ -0,0 +1,126 @@
+#ifndef MINICAP_TRACER_HPP
+#define MINICAP_TRACER_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Protocol.hpp"
+
+// Records where the time of each frame goes (-T), from the backend saying
+// a frame is available to the last byte sent, and writes it out in the
+// Chrome trace event format for chrome://tracing or Perfetto.
+//
+// Events go into a ring allocated up front, claimed with a single atomic
+// increment so that any thread may record without locking; the oldest
+// events are overwritten. Each slot carries a sequence number written last,
+// which lets the dump skip slots that were being rewritten as it read them.
+// The trace is written on SIGUSR2 and on exit. When tracing is off,
+// recording costs one relaxed load.
+class Tracer {
+public:
+  Tracer();
+
+  ~Tracer();
+
+  // Enables tracing into a ring of the given number of events, dumped to
+  // path.
+  bool
+  start(const std::string& path, size_t capacity);
+
+  // Writes a final dump and stops.
+  void
+  stop();
+
+  bool
+  isEnabled() const {
+    return mEnabled.load(std::memory_order_relaxed);
+  }
+
+  // A stage of the given frame that ran from start to end (microseconds,
+  // monotonicTimestamp()). Name must be a string literal.
+  void
+  complete(const char* name, uint32_t frame, uint64_t start, uint64_t end) {
+    if (isEnabled()) {
+      record(name, 'X', frame, start, end - start);
+    }
+  }
+
+  // Something that happened right now.
+  void
+  instant(const char* name, uint32_t frame) {
+    if (isEnabled()) {
+      record(name, 'i', frame, monotonicTimestamp(), 0);
+    }
+  }
+
+  // Asks for a dump from a signal handler.
+  void
+  requestDump();
+
+  // Writes the ring out right away.
+  bool
+  dump();
+
+private:
+  struct Event {
+    std::atomic<uint64_t> sequence;
+    const char* name;
+    char phase;
+    uint32_t thread;
+    uint32_t frame;
+    uint64_t timestamp;
+    uint64_t duration;
+  };
+
+  std::atomic<bool> mEnabled;
+  std::string mPath;
+  Event* mEvents;
+  size_t mMask;
+  std::atomic<uint64_t> mNext;
+  // Written to by the signal handler, read by mThread.
+  int mPipe[2];
+  std::thread mThread;
+
+  void
+  record(const char* name, char phase, uint32_t frame, uint64_t timestamp,
+    uint64_t duration);
+
+  void
+  run();
+};
+
+extern Tracer gTracer;
+
+// Traces the time from construction to destruction or end().
+class TraceScope {
+public:
+  TraceScope(const char* name, uint32_t frame)
+    : mName(name),
+      mFrame(frame),
+      mStart(gTracer.isEnabled() ? monotonicTimestamp() : 0) {
+  }
+
+  ~TraceScope() {
+    end();
+  }
+
+  void
+  end() {
+    if (mStart != 0) {
+      gTracer.complete(mName, mFrame, mStart, monotonicTimestamp());
+      mStart = 0;
+    }
+  }
+
+private:
+  const char* mName;
+  uint32_t mFrame;
+  uint64_t mStart;
+};
+
+#endif
@@ -0,0 +1,230 @@
+#include "WebSocket.hpp"
+
+#include <string.h>
+#include <sys/socket.h>
+
+#include "util/debug.h"
+
+#define HANDSHAKE_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+// Commands are short, anything bigger is somebody else talking.
+#define MAX_PAYLOAD_SIZE 65536
+
+static inline uint32_t
+rotate_left(uint32_t value, int bits) {
+  return (value << bits) | (value >> (32 - bits));
+}
+
+static void
+sha1_block(uint32_t state[5], const unsigned char* block) {
+  uint32_t w[80];
+
+  for (int i = 0; i < 16; ++i) {
+    w[i] = (block[i * 4] << 24) | (block[i * 4 + 1] << 16) |
+      (block[i * 4 + 2] << 8) | block[i * 4 + 3];
+  }
+
+  for (int i = 16; i < 80; ++i) {
+    w[i] = rotate_left(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  }
+
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+  for (int i = 0; i < 80; ++i) {
+    uint32_t f, k;
+
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5A827999;
+    }
+    else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ED9EBA1;
+    }
+    else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8F1BBCDC;
+    }
+    else {
+      f = b ^ c ^ d;
+      k = 0xCA62C1D6;
+    }
+
+    uint32_t temp = rotate_left(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rotate_left(b, 30);
+    b = a;
+    a = temp;
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+void
+WebSocket::sha1(const unsigned char* data, size_t length, unsigned char digest[20]) {
+  uint32_t state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+  size_t i = 0;
+
+  for (; i + 64 <= length; i += 64) {
+    sha1_block(state, data + i);
+  }
+
+  // The rest, a one bit, zeros and the length in bits, in one or two
+  // blocks.
+  unsigned char tail[128];
+  size_t rest = length - i;
+  size_t tailSize = rest + 9 <= 64 ? 64 : 128;
+  uint64_t bits = static_cast<uint64_t>(length) * 8;
+
+  memset(tail, 0, sizeof(tail));
+  memcpy(tail, data + i, rest);
+  tail[rest] = 0x80;
+
+  for (int j = 0; j < 8; ++j) {
+    tail[tailSize - 1 - j] = bits >> (j * 8);
+  }
+
+  for (size_t j = 0; j < tailSize; j += 64) {
+    sha1_block(state, tail + j);
+  }
+
+  for (int j = 0; j < 5; ++j) {
+    digest[j * 4] = state[j] >> 24;
+    digest[j * 4 + 1] = state[j] >> 16;
+    digest[j * 4 + 2] = state[j] >> 8;
+    digest[j * 4 + 3] = state[j];
+  }
+}
+
+std::string
+WebSocket::base64(const unsigned char* data, size_t length) {
+  static const char ALPHABET[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+
+  for (size_t i = 0; i < length; i += 3) {
+    uint32_t group = data[i] << 16;
+    if (i + 1 < length) {
+      group |= data[i + 1] << 8;
+    }
+    if (i + 2 < length) {
+      group |= data[i + 2];
+    }
+
+    out += ALPHABET[(group >> 18) & 0x3F];
+    out += ALPHABET[(group >> 12) & 0x3F];
+    out += i + 1 < length ? ALPHABET[(group >> 6) & 0x3F] : '=';
+    out += i + 2 < length ? ALPHABET[group & 0x3F] : '=';
+  }
+
+  return out;
+}
+
+bool
+WebSocket::isUpgrade(const HttpRequest& request) {
+  return request.getMethod() == "GET" &&
+    request.hasToken("Upgrade", "websocket") &&
+    !request.getHeader("Sec-WebSocket-Key").empty();
+}
+
+bool
+WebSocket::accept(int fd, const HttpRequest& request) {
+  std::string key = request.getHeader("Sec-WebSocket-Key") + HANDSHAKE_GUID;
+  unsigned char digest[20];
+
+  sha1(reinterpret_cast<const unsigned char*>(key.data()), key.size(), digest);
+
+  std::string response =
+    "HTTP/1.1 101 Switching Protocols\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Accept: " + base64(digest, sizeof(digest)) + "\r\n\r\n";
+
+  return send(fd, response.data(), response.size(), MSG_NOSIGNAL) ==
+    static_cast<ssize_t>(response.size());
+}
+
+size_t
+WebSocket::putHeader(unsigned char* out, Opcode opcode, uint64_t length) {
+  out[0] = 0x80 | opcode;
+
+  if (length < 126) {
+    out[1] = length;
+    return 2;
+  }
+
+  if (length <= 0xFFFF) {
+    out[1] = 126;
+    out[2] = length >> 8;
+    out[3] = length;
+    return 4;
+  }
+
+  out[1] = 127;
+  for (int i = 0; i < 8; ++i) {
+    out[2 + i] = length >> ((7 - i) * 8);
+  }
+  return 10;
+}
+
+long
+WebSocket::parseFrame(const std::string& data, Opcode& opcode, bool& fin, std::string& payload) {
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data.data());
+  size_t size = data.size();
+
+  if (size < 2) {
+    return 0;
+  }
+
+  fin = (bytes[0] & 0x80) != 0;
+  opcode = static_cast<Opcode>(bytes[0] & 0x0F);
+
+  // Clients must mask.
+  if ((bytes[1] & 0x80) == 0) {
+    return -1;
+  }
+
+  uint64_t length = bytes[1] & 0x7F;
+  size_t offset = 2;
+
+  if (length == 126) {
+    if (size < 4) {
+      return 0;
+    }
+    length = (bytes[2] << 8) | bytes[3];
+    offset = 4;
+  }
+  else if (length == 127) {
+    if (size < 10) {
+      return 0;
+    }
+    length = 0;
+    for (int i = 0; i < 8; ++i) {
+      length = (length << 8) | bytes[2 + i];
+    }
+    offset = 10;
+  }
+
+  if (length > MAX_PAYLOAD_SIZE) {
+    return -1;
+  }
+
+  if (size < offset + 4 + length) {
+    return 0;
+  }
+
+  const unsigned char* mask = bytes + offset;
+  offset += 4;
+
+  payload.resize(length);
+  for (size_t i = 0; i < length; ++i) {
+    payload[i] = bytes[offset + i] ^ mask[i % 4];
+  }
+
+  return offset + length;
+}
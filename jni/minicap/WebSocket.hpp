@@ -0,0 +1,59 @@
+#ifndef MINICAP_WEB_SOCKET_HPP
+#define MINICAP_WEB_SOCKET_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include "HttpRequest.hpp"
+
+// Server messages are never masked, so their header is 2, 4 or 10 bytes.
+#define WEBSOCKET_MAX_HEADER_SIZE 10
+
+// Just enough of RFC 6455 for browsers to connect to the stream port
+// directly: the upgrade handshake, unfragmented server messages and
+// decoding of whatever the browser sends back.
+//
+// Over a WebSocket the banner is the first binary message, and every frame
+// is a binary message holding exactly what follows the 4-byte length in
+// the raw protocol (the frame header if enabled, then the payload).
+// Commands are sent as text messages, one or more lines each.
+class WebSocket {
+public:
+  enum Opcode {
+    OPCODE_CONTINUATION  = 0x0,
+    OPCODE_TEXT          = 0x1,
+    OPCODE_BINARY        = 0x2,
+    OPCODE_CLOSE         = 0x8,
+    OPCODE_PING          = 0x9,
+    OPCODE_PONG          = 0xA,
+  };
+
+  // Whether the request asks for a WebSocket.
+  static bool
+  isUpgrade(const HttpRequest& request);
+
+  // Completes the handshake for an upgrade request.
+  static bool
+  accept(int fd, const HttpRequest& request);
+
+  // Writes the header of a complete message with a payload of the given
+  // length. Returns its size, at most WEBSOCKET_MAX_HEADER_SIZE.
+  static size_t
+  putHeader(unsigned char* out, Opcode opcode, uint64_t length);
+
+  // Parses the (masked) client frame at the start of data and unmasks its
+  // payload. Returns the size of the frame, 0 if it's incomplete or -1 if
+  // it isn't valid.
+  static long
+  parseFrame(const std::string& data, Opcode& opcode, bool& fin, std::string& payload);
+
+  static void
+  sha1(const unsigned char* data, size_t length, unsigned char digest[20]);
+
+  static std::string
+  base64(const unsigned char* data, size_t length);
+};
+
+#endif
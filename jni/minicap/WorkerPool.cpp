@@ -0,0 +1,96 @@
+#include "WorkerPool.hpp"
+
+#include <algorithm>
+
+#include "ThreadPolicy.hpp"
+#include "util/debug.h"
+
+WorkerPool::WorkerPool(unsigned int size)
+  : mStopped(false) {
+  if (size == 0) {
+    size = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  // The caller participates, so one fewer thread is needed.
+  for (unsigned int i = 1; i < size; ++i) {
+    mThreads.push_back(std::thread(&WorkerPool::run, this));
+  }
+
+  MCINFO("Worker pool started with %d threads", size);
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mStopped = true;
+    mWork.notify_all();
+  }
+
+  for (auto& thread: mThreads) {
+    thread.join();
+  }
+}
+
+void
+WorkerPool::parallelFor(unsigned int count, const Task& task) {
+  if (count == 0) {
+    return;
+  }
+
+  if (count == 1 || mThreads.empty()) {
+    for (unsigned int i = 0; i < count; ++i) {
+      task(i);
+    }
+    return;
+  }
+
+  Batch batch;
+  batch.task = &task;
+  batch.count = count;
+  batch.next = 0;
+  batch.remaining = count;
+
+  std::unique_lock<std::mutex> lock(mMutex);
+  mQueue.push_back(&batch);
+  mWork.notify_all();
+
+  drain(&batch, lock);
+
+  mDone.wait(lock, [&batch]{return batch.remaining == 0;});
+}
+
+void
+WorkerPool::drain(Batch* batch, std::unique_lock<std::mutex>& lock) {
+  while (batch->next < batch->count) {
+    unsigned int index = batch->next++;
+
+    if (batch->next == batch->count) {
+      mQueue.erase(std::find(mQueue.begin(), mQueue.end(), batch));
+    }
+
+    lock.unlock();
+    (*batch->task)(index);
+    lock.lock();
+
+    if (--batch->remaining == 0) {
+      mDone.notify_all();
+    }
+  }
+}
+
+void
+WorkerPool::run() {
+  ThreadPolicy::apply(ThreadPolicy::ROLE_WORKERS);
+
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  while (true) {
+    mWork.wait(lock, [this]{return mStopped || !mQueue.empty();});
+
+    if (mStopped) {
+      return;
+    }
+
+    drain(mQueue.front(), lock);
+  }
+}
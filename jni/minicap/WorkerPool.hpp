@@ -0,0 +1,58 @@
+#ifndef MINICAP_WORKER_POOL_HPP
+#define MINICAP_WORKER_POOL_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads for splitting CPU heavy work (compression,
+// conversion) into independent chunks. Several callers may share one pool;
+// their batches are interleaved.
+class WorkerPool {
+public:
+  typedef std::function<void(unsigned int)> Task;
+
+  // A size of 0 uses one thread per online CPU. The calling thread also
+  // takes part in its own batches, so a pool of size 1 doubles throughput.
+  WorkerPool(unsigned int size = 0);
+
+  ~WorkerPool();
+
+  // Runs task(0) ... task(count - 1) concurrently and returns once every
+  // one of them has finished.
+  void
+  parallelFor(unsigned int count, const Task& task);
+
+  unsigned int
+  size() {
+    return mThreads.size() + 1;
+  }
+
+private:
+  struct Batch {
+    const Task* task;
+    unsigned int count;
+    unsigned int next;
+    unsigned int remaining;
+  };
+
+  std::vector<std::thread> mThreads;
+  std::mutex mMutex;
+  std::condition_variable mWork;
+  std::condition_variable mDone;
+  std::deque<Batch*> mQueue;
+  bool mStopped;
+
+  void
+  run();
+
+  // Claims and runs chunks of the batch until none are left to claim.
+  // Must be called with the lock held; returns with it held.
+  void
+  drain(Batch* batch, std::unique_lock<std::mutex>& lock);
+};
+
+#endif
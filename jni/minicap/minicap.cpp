@@ -1,6 +1,7 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <linux/fb.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
@@ -18,37 +19,93 @@
 #include <libyuv.h>
 using namespace libyuv;
 #include "util/debug.h"
+#include "CommandReader.hpp"
+#include "DisplayStream.hpp"
+#include "FlightRecorder.hpp"
+#include "FramePool.hpp"
+#include "FrameWaiter.hpp"
 #include "JpgEncoder.hpp"
-#include "SimpleServer.hpp"
+#include "Metrics.hpp"
+#include "Protocol.hpp"
+#include "Recorder.hpp"
+#include "RtpSender.hpp"
+#include "ScreenshotEncoder.hpp"
+#include "Simulcast.hpp"
+#include "ThreadPolicy.hpp"
+#include "Tracer.hpp"
+#include "WorkerPool.hpp"
 #include "Projection.hpp"
 
-#define BANNER_VERSION 1
-#define BANNER_SIZE 24
-
 #define DEFAULT_SOCKET_NAME "minicap"
 #define DEFAULT_DISPLAY_ID 0
+#define DEFAULT_PORT 9999
+#define DEFAULT_UDP_KBPS 20000
 #define DEFAULT_JPG_QUALITY 80
 #define DEFAULT_SAMPLE_TYPE TJSAMP_420
-enum {
-  QUIRK_DUMB            = 1,
-  QUIRK_ALWAYS_UPRIGHT  = 2,
-  QUIRK_TEAR            = 4,
-};
 
 static void
 usage(const char* pname) {
   printf("okok");
   fprintf(stderr,
     "Usage: %s [-h] [-n <name>]\n"
-    "  -d <id>:       Display ID. (%d)\n"
+    "  -d <value>:    Display to stream (<id>[:<port>[:<format>[:<scale>]]]), the\n"
+    "                 port defaulting to %d plus its position. Repeat for more\n"
+    "                 displays; the first one is described by -P and is used for\n"
+    "                 screenshots and recordings. (%d) Browsers can also connect\n"
+    "                 to the port directly over a WebSocket, or show the stream\n"
+    "                 as MJPEG from http://<host>:<port>/stream.mjpeg (-Q).\n"
     "  -n <name>:     Change the name of the abtract unix domain socket. (%s)\n"
     "  -P <value>:    Display projection (<w>x<h>@<w>x<h>/{0|90|180|270}).\n"
-    //"  -Q <value>:    JPEG quality (0-100).\n"
+    "  -Q <value>:    JPEG quality (0-100).\n"
     "  -s:            Take a screenshot and output it to stdout. Needs -P.\n"
+    "  -o <value>:    Screenshot format: yuv (default), png (lossless) or jpg (-Q).\n"
+    "  -b <value>:    Burst of screenshots (<count>[@<interval ms>]), or \"-\" to\n"
+    "                 take one per \"shot\" line on stdin until \"quit\". Implies -s.\n"
+    "                 Each image is prefixed by its length and a frame header.\n"
     "  -S:            Skip frames when they cannot be consumed quickly enough.\n"
+    "                 This is the default now; the flag is accepted but ignored.\n"
     "  -t:            Attempt to get the capture method running, then exit.\n"
     "  -i:            Get display information in JSON format. May segfault.\n"
-    "  -f:            0:I420, 1:NV12"
+    "  -f:            0:I420, 1:NV12, 2:JPEG (-Q), 4:gray (luma only), 5:RGBA as\n"
+    "                 captured (no crop or scale). Can be changed at runtime with\n"
+    "                 \"format <value>\" if -H is given.\n"
+    "  -C <value>:    Only capture a region of the frame (<x>,<y>,<w>,<h>[,<scale>]).\n"
+    "                 Can be changed at runtime with \"crop <value>\" or \"crop off\".\n"
+    "  -H:            Prefix every frame with an extended frame header.\n"
+    "  -u:            Pull mode: clients only get a frame after sending \"frame\",\n"
+    "                 converted from the newest one at that point. Clients can\n"
+    "                 also switch with \"frame\" and back with \"push\".\n"
+    "  -e:            Send scrolling as a shift instruction plus the newly exposed\n"
+    "                 strip (FRAME_TYPE_SHIFT). Implies -H.\n"
+    "  -l <rows>:     Send full size frames in strips of <rows> rows while they're\n"
+    "                 still being converted (FRAME_TYPE_STRIP). Implies -H.\n"
+    "  -a <ms>:       Keep latency under <ms> on slow links by skipping frames for\n"
+    "                 congested clients, then lowering JPEG quality, then size\n"
+    "                 (needs -H or JPEG).\n"
+    "  -c:            Losslessly compress frames (delta + RLE), see\n"
+    "                 FrameCompressor.hpp and example/mcz.js for the format.\n"
+    "  -R <value>:    Record the stream to <dir>[:<segment seconds>] (60), with a\n"
+    "                 seekable index per segment. Runs without a client, too.\n"
+    "  -m <value>:    Keep the last <megabytes>[:<seconds>[:<dir>]] (30) of frames in\n"
+    "                 memory. Clients get them with \"flight send\" (needs -H), or\n"
+    "                 have them written to <dir> with \"flight dump <file name>\".\n"
+    "  -M <port>:     Serve Prometheus metrics over HTTP on <port>.\n"
+    "  -U <value>:    Also send the stream over UDP to <host>:<port>[@<kbps>] (%d),\n"
+    "                 in RTP-style packets paced at <kbps>. Frames that lose a\n"
+    "                 packet are dropped, see example/rtp-receiver.js.\n"
+    "  -y <seconds>:  Tear down the virtual display after <seconds> without clients,\n"
+    "                 and recreate it when one connects.\n"
+    "  -K <value>:    CPUs and scheduling for a role of threads, e.g. stream=big:-10.\n"
+    "                 <role>=<cpus>[:<policy>] with roles capture, stream, workers\n"
+    "                 and io; cpus big, little, prime, all or a list like 0-3,6;\n"
+    "                 policy a nice value or fifo[<priority>]. Repeatable.\n"
+    "  -T <value>:    Trace the last <events> (65536) per-frame stages to\n"
+    "                 <path>[:<events>] in the Chrome trace event format, written\n"
+    "                 on SIGUSR2 and on exit.\n"
+    "  -p <value>:    Also produce smaller renditions of the stream, e.g. 1,0.5,0.25.\n"
+    "                 Clients pick one with \"rendition <index>\", 0 being full size.\n"
+    "  -B <path>:     Capture from a framebuffer device (e.g. /dev/graphics/fb0)\n"
+    "                 or a raw RGBA file of the -P real size instead.\n"
     /*
     "  -x <value>:    Get the scaling factors of libjpeg-turbo.\r\n"
     "                 Scaling: 2/1 (Percentage: 2.000000)\r\n"
@@ -76,82 +133,10 @@ usage(const char* pname) {
     "                 TJSAMP_411    5\r\n"
     */
     "  -h:            Show help.\n",
-    pname, DEFAULT_DISPLAY_ID, DEFAULT_SOCKET_NAME
+    pname, DEFAULT_PORT, DEFAULT_DISPLAY_ID, DEFAULT_SOCKET_NAME, DEFAULT_UDP_KBPS
   );
 }
 
-class FrameWaiter: public Minicap::FrameAvailableListener {
-public:
-  FrameWaiter()
-    : mPendingFrames(0),
-      mTimeout(std::chrono::milliseconds(100)),
-      mStopped(false) {
-  }
-
-  int
-  waitForFrame() {
-    std::unique_lock<std::mutex> lock(mMutex);
-
-    while (!mStopped) {
-      if (mCondition.wait_for(lock, mTimeout, [this]{return mPendingFrames > 0;})) {
-        return mPendingFrames--;
-      }
-    }
-
-    return 0;
-  }
-
-  void
-  reportExtraConsumption(int count) {
-    std::unique_lock<std::mutex> lock(mMutex);
-    mPendingFrames -= count;
-  }
-
-  void
-  onFrameAvailable() {
-    std::unique_lock<std::mutex> lock(mMutex);
-    mPendingFrames += 1;
-    mCondition.notify_one();
-  }
-
-  void
-  stop() {
-    mStopped = true;
-  }
-
-  bool
-  isStopped() {
-    return mStopped;
-  }
-
-private:
-  std::mutex mMutex;
-  std::condition_variable mCondition;
-  std::chrono::milliseconds mTimeout;
-  int mPendingFrames;
-  bool mStopped;
-};
-
-static int
-pumps(int fd, unsigned char* data, size_t length) {
-  do {
-    // Make sure that we don't generate a SIGPIPE even if the socket doesn't
-    // exist anymore. We'll still get an EPIPE which is perfect.
-    int wrote = send(fd, data, length, 0/*, MSG_NOSIGNAL*/);
-
-    if (wrote < 0) {
-      return wrote;
-    }
-
-    data += wrote;
-    length -= wrote;
-  }
-  while (length > 0);
-
-  return 0;
-}
-
-
 static int
 pumpf(int fd, unsigned char* data, size_t length) {
   //MCERROR("YUV Size: %d", length);
@@ -170,13 +155,35 @@ pumpf(int fd, unsigned char* data, size_t length) {
   return 0;
 }
 
-static int
-putUInt32LE(unsigned char* data, int value) {
-  data[0] = (value & 0x000000FF) >> 0;
-  data[1] = (value & 0x0000FF00) >> 8;
-  data[2] = (value & 0x00FF0000) >> 16;
-  data[3] = (value & 0xFF000000) >> 24;
-}
+// A display to stream, as given with -d. Unset values fall back to the
+// global options.
+struct DisplaySpec {
+  int32_t id;
+  int port;
+  int format;
+  float scaling;
+
+  DisplaySpec(): id(DEFAULT_DISPLAY_ID), port(0), format(-1), scaling(0) {
+  }
+
+  // Parses "<id>[:<port>[:<format>[:<scale>]]]".
+  static bool
+  parse(DisplaySpec& spec, const char* value) {
+    DisplaySpec parsed;
+    int n = sscanf(value, "%d:%d:%d:%f", &parsed.id, &parsed.port, &parsed.format, &parsed.scaling);
+
+    if (n < 1 || parsed.id < 0 || parsed.port < 0 || parsed.port > 65535 ||
+        (n >= 3 && parsed.format != FRAME_FORMAT_I420 && parsed.format != FRAME_FORMAT_NV12 &&
+          parsed.format != FRAME_FORMAT_JPG && parsed.format != FRAME_FORMAT_GRAY &&
+          parsed.format != FRAME_FORMAT_RGBA) ||
+        (n >= 4 && parsed.scaling <= 0)) {
+      return false;
+    }
+
+    spec = parsed;
+    return true;
+  }
+};
 
 static int
 try_get_framebuffer_display_info(uint32_t displayId, Minicap::DisplayInfo* info) {
@@ -215,18 +222,19 @@ try_get_framebuffer_display_info(uint32_t displayId, Minicap::DisplayInfo* info)
   return 0;
 }
 
-static FrameWaiter gWaiter;
-
 static void
 signal_handler(int signum) {
   switch (signum) {
   case SIGINT:
     MCINFO("Received SIGINT, stopping");
-    gWaiter.stop();
+    FrameWaiter::stopAll();
     break;
   case SIGTERM:
     MCINFO("Received SIGTERM, stopping");
-    gWaiter.stop();
+    FrameWaiter::stopAll();
+    break;
+  case SIGUSR2:
+    gTracer.requestDump();
     break;
   default:
     abort();
@@ -234,6 +242,131 @@ signal_handler(int signum) {
   }
 }
 
+// Waits for the next "shot" line on stdin. Returns false on "quit", EOF
+// or when stopped.
+static bool
+wait_for_shot(CommandReader& commands, bool& eof) {
+  CommandReader::Command command;
+
+  while (!FrameWaiter::isStopped()) {
+    while (commands.nextCommand(command)) {
+      if (command[0] == "shot") {
+        return true;
+      }
+
+      if (command[0] == "quit") {
+        return false;
+      }
+
+      MCWARN("Ignoring unknown command '%s'", command[0].c_str());
+    }
+
+    if (eof) {
+      return false;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = commands.getFd();
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 100) < 0 && errno != EINTR) {
+      return false;
+    }
+
+    eof = !commands.readAvailable();
+  }
+
+  return false;
+}
+
+// Writes a series of screenshots to stdout, each prefixed by its length
+// and a FrameHeader. Capture stays set up between shots so that only
+// capture and encode are paid per image, and if the screen hasn't changed
+// since the previous shot its encoding is simply sent again.
+static int
+run_burst(Minicap* minicap, FrameWaiter& waiter, ScreenshotEncoder& screenshot,
+    const Crop& crop, int count, unsigned int interval) {
+  Minicap::Frame frame;
+  bool haveFrame = false;
+  bool eof = false;
+  uint32_t sequence = 0;
+  uint64_t timestamp = 0;
+  int result = EXIT_FAILURE;
+
+  CommandReader commands(STDIN_FILENO);
+  if (count < 0) {
+    fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+  }
+
+  std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+
+  while (count < 0 || sequence < static_cast<uint32_t>(count)) {
+    if (count < 0) {
+      if (!wait_for_shot(commands, eof)) {
+        break;
+      }
+    }
+    else if (sequence > 0 && interval > 0) {
+      next += std::chrono::milliseconds(interval);
+      std::this_thread::sleep_until(next);
+    }
+
+    int pending = haveFrame ? waiter.tryWaitForFrames() : waiter.waitForFrames();
+
+    if (FrameWaiter::isStopped()) {
+      break;
+    }
+
+    if (pending > 0) {
+      if (haveFrame) {
+        minicap->releaseConsumedFrame(&frame);
+        haveFrame = false;
+      }
+
+      int skipped;
+      if (minicap->consumeLatestFrame(&frame, pending, &skipped) != 0) {
+        MCERROR("Unable to consume pending frame");
+        goto done;
+      }
+
+      gMetrics.framesSkipped.add(skipped);
+      haveFrame = true;
+      timestamp = monotonicTimestamp();
+
+      if (!screenshot.encode(&frame, crop)) {
+        MCERROR("Unable to encode frame");
+        goto done;
+      }
+    }
+
+    unsigned char header[4 + FRAME_HEADER_SIZE];
+    FrameHeader frameHeader;
+    frameHeader.format = screenshot.getFrameFormat();
+    frameHeader.sequence = sequence++;
+    frameHeader.x = crop.active() ? crop.x : 0;
+    frameHeader.y = crop.active() ? crop.y : 0;
+    frameHeader.width = screenshot.getWidth();
+    frameHeader.height = screenshot.getHeight();
+    frameHeader.timestamp = timestamp;
+    frameHeader.serialize(header + 4);
+    putUInt32LE(header, FRAME_HEADER_SIZE + screenshot.getEncodedSize());
+
+    if (pumpf(STDOUT_FILENO, header, sizeof(header)) < 0 ||
+        pumpf(STDOUT_FILENO, screenshot.getEncodedData(), screenshot.getEncodedSize()) < 0) {
+      MCERROR("Unable to output encoded frame data");
+      goto done;
+    }
+  }
+
+  result = EXIT_SUCCESS;
+
+done:
+  if (haveFrame) {
+    minicap->releaseConsumedFrame(&frame);
+  }
+
+  return result;
+}
+
 int
 main(int argc, char* argv[]) {
   const char* pname = argv[0];
@@ -243,19 +376,52 @@ main(int argc, char* argv[]) {
   unsigned int sampling = DEFAULT_SAMPLE_TYPE;
   bool showInfo = false;
   bool takeScreenshot = false;
-  bool skipFrames = false;
   bool testOnly = false;
   bool scalingFactors = false;
+  bool frameHeaders = false;
+  bool pull = false;
+  int detachAfter = -1;
+  bool compress = false;
+  bool detectScroll = false;
+  uint32_t stripRows = 0;
+  unsigned int targetLatency = 0;
+  int burstCount = 0;
+  int metricsPort = 0;
+  const char* recordDir = NULL;
+  const char* framebufferPath = NULL;
+  unsigned int segmentSeconds = 60;
+  unsigned int flightMegabytes = 0;
+  unsigned int flightSeconds = 30;
+  const char* flightDir = NULL;
+  const char* tracePath = NULL;
+  unsigned int traceEvents = 65536;
+  const char* udpHost = NULL;
+  const char* udpPort = NULL;
+  unsigned int udpKbps = DEFAULT_UDP_KBPS;
+  unsigned int burstInterval = 0;
+  ScreenshotEncoder::Format screenshotFormat = ScreenshotEncoder::FORMAT_YUV;
   unsigned int format = 0;
   float scaling = 0.5;
+  Crop crop;
   Projection proj;
+  std::vector<DisplaySpec> displays;
+  std::vector<float> renditions(1, 1.0f);
 
   int opt;
-  while ((opt = getopt(argc, argv, "x:z:d:n:P:f:Q:siSth")) != -1) {
+  while ((opt = getopt(argc, argv, "x:z:d:n:P:f:Q:C:o:b:R:m:M:B:p:l:a:T:K:y:U:siSthHceu")) != -1) {
     switch (opt) {
-    case 'd':
-      displayId = atoi(optarg);
+    case 'd': {
+      DisplaySpec spec;
+      if (!DisplaySpec::parse(spec, optarg)) {
+        std::cerr << "ERROR: invalid format for -d, need <id>[:<port>[:<format>[:<scale>]]]" << std::endl;
+        return EXIT_FAILURE;
+      }
+      if (displays.empty()) {
+        displayId = spec.id;
+      }
+      displays.push_back(spec);
       break;
+    }
     case 'n':
       sockname = optarg;
       break;
@@ -270,6 +436,148 @@ main(int argc, char* argv[]) {
     case 'f':
       format = atoi(optarg);
       break;
+    case 'C':
+      if (!Crop::parse(crop, optarg)) {
+        std::cerr << "ERROR: invalid format for -C, need <x>,<y>,<w>,<h>[,<scale>]" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'H':
+      frameHeaders = true;
+      break;
+    case 'c':
+      compress = true;
+      break;
+    case 'u':
+      pull = true;
+      break;
+    case 'y': {
+      char* end;
+      detachAfter = strtol(optarg, &end, 10);
+      if (*optarg == '\0' || *end != '\0' || detachAfter < 0) {
+        std::cerr << "ERROR: invalid value for -y, need seconds" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    }
+    case 'e':
+      detectScroll = true;
+      frameHeaders = true;
+      break;
+    case 'l':
+      stripRows = atoi(optarg);
+      if (stripRows == 0) {
+        std::cerr << "ERROR: invalid value for -l, need a number of rows" << std::endl;
+        return EXIT_FAILURE;
+      }
+      frameHeaders = true;
+      break;
+    case 'a':
+      targetLatency = atoi(optarg);
+      if (targetLatency == 0) {
+        std::cerr << "ERROR: invalid value for -a, need milliseconds" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'b':
+      takeScreenshot = true;
+      if (strcmp(optarg, "-") == 0) {
+        burstCount = -1;
+      }
+      else if (sscanf(optarg, "%d@%u", &burstCount, &burstInterval) < 1 || burstCount <= 0) {
+        std::cerr << "ERROR: invalid format for -b, need <count>[@<interval ms>] or -" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'R': {
+      // <dir>[:<seconds>]
+      char* colon = strrchr(optarg, ':');
+      if (colon != NULL) {
+        *colon = '\0';
+        segmentSeconds = atoi(colon + 1);
+      }
+      recordDir = optarg;
+      if (*recordDir == '\0' || segmentSeconds == 0) {
+        std::cerr << "ERROR: invalid format for -R, need <dir>[:<seconds>]" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    }
+    case 'T': {
+      // <path>[:<events>]
+      char* colon = strrchr(optarg, ':');
+      if (colon != NULL) {
+        *colon = '\0';
+        traceEvents = atoi(colon + 1);
+      }
+      tracePath = optarg;
+      if (*tracePath == '\0' || traceEvents == 0) {
+        std::cerr << "ERROR: invalid format for -T, need <path>[:<events>]" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    }
+    case 'U': {
+      // <host>:<port>[@<kbps>]
+      char* at = strrchr(optarg, '@');
+      if (at != NULL) {
+        *at = '\0';
+        udpKbps = atoi(at + 1);
+      }
+      char* colon = strrchr(optarg, ':');
+      if (colon == NULL || colon == optarg || colon[1] == '\0' || udpKbps == 0) {
+        std::cerr << "ERROR: invalid format for -U, need <host>:<port>[@<kbps>]" << std::endl;
+        return EXIT_FAILURE;
+      }
+      *colon = '\0';
+      udpHost = optarg;
+      udpPort = colon + 1;
+      break;
+    }
+    case 'K':
+      if (!ThreadPolicy::parse(optarg)) {
+        std::cerr << "ERROR: invalid format for -K, need <role>=<cpus>[:<policy>]" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'm': {
+      // <megabytes>[:<seconds>[:<dir>]]
+      char* colon = strchr(optarg, ':');
+      char* dir = colon != NULL ? strchr(colon + 1, ':') : NULL;
+      if (dir != NULL) {
+        *dir = '\0';
+        flightDir = dir + 1;
+      }
+      if (sscanf(optarg, "%u:%u", &flightMegabytes, &flightSeconds) < 1 ||
+          flightMegabytes == 0 || flightSeconds == 0 ||
+          (flightDir != NULL && *flightDir == '\0')) {
+        std::cerr << "ERROR: invalid format for -m, need <megabytes>[:<seconds>[:<dir>]]" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    }
+    case 'M':
+      metricsPort = atoi(optarg);
+      if (metricsPort <= 0 || metricsPort > 65535) {
+        std::cerr << "ERROR: invalid port for -M" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'B':
+      framebufferPath = optarg;
+      break;
+    case 'p':
+      if (!Simulcast::parseScales(renditions, optarg)) {
+        std::cerr << "ERROR: invalid format for -p, need decreasing scales like 1,0.5,0.25" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'o':
+      if (!ScreenshotEncoder::parseFormat(screenshotFormat, optarg)) {
+        std::cerr << "ERROR: invalid format for -o, need yuv, png or jpg" << std::endl;
+        return EXIT_FAILURE;
+      }
+      break;
     case 'Q':
       quality = atoi(optarg);
       break;
@@ -280,7 +588,7 @@ main(int argc, char* argv[]) {
       showInfo = true;
       break;
     case 'S':
-      skipFrames = true;
+      // Always on now, kept for compatibility.
       break;
     case 't':
       testOnly = true;
@@ -312,6 +620,18 @@ main(int argc, char* argv[]) {
   sigaction(SIGTERM, &sa, NULL);
   sigaction(SIGINT, &sa, NULL);
 
+  // A client going away mid-write must show up as EPIPE on that client,
+  // not take down the whole process.
+  signal(SIGPIPE, SIG_IGN);
+
+  if (tracePath != NULL) {
+    if (!gTracer.start(tracePath, traceEvents)) {
+      return EXIT_FAILURE;
+    }
+
+    sigaction(SIGUSR2, &sa, NULL);
+  }
+
   // Start Android's thread pool so that it will be able to serve our requests.
   minicap_start_thread_pool();
 
@@ -400,7 +720,7 @@ main(int argc, char* argv[]) {
   std::cerr << "PID: " << getpid() << std::endl;
   std::cerr << "INFO: Using projection " << proj << std::endl;
   std::cerr << "INFO: Sampling  " << JpgEncoder::convertSampling(sampling) << std::endl;
-  std::cerr << "INFO: Scaling  " << proj.realWidth * scaling << "*" << proj.realHeight * scaling << std::endl;
+  std::cerr << "INFO: Scaling  " << proj.virtualWidth * scaling << "*" << proj.virtualHeight * scaling << std::endl;
   std::cerr << "INFO: Quality  " << quality << std::endl;
   // Disable STDOUT buffering.
   setbuf(stdout, NULL);
@@ -416,225 +736,225 @@ main(int argc, char* argv[]) {
   desiredInfo.height = proj.virtualHeight;
   desiredInfo.orientation = proj.rotation;
 
-  // Leave a 4-byte padding to the encoder so that we can inject the size
-  // to the same buffer.
-  // defaule sample type: TJSAMP_420
-  //JpgEncoder encoder(4, 0, sampling, scaling);
-  //
-  //i420p支持机型
-  //i420sp支持机型
-  
-  YUVEncoder encoder = YUVEncoder(format == 0 ? FOURCC_I420 : FOURCC_NV12);
-  Minicap::Frame frame;
-  bool haveFrame = false;
-
-  // Server config.
-  SimpleServer server;
-
-  // Set up minicap.
-  Minicap* minicap = minicap_create(displayId);
-  if (minicap == NULL) {
-    return EXIT_FAILURE;
+  if (displays.empty()) {
+    displays.push_back(DisplaySpec());
   }
 
-  // Figure out the quirks the current capture method has.
-  unsigned char quirks = 0;
-  switch (minicap->getCaptureMethod()) {
-  case Minicap::METHOD_FRAMEBUFFER:
-    quirks |= QUIRK_DUMB | QUIRK_TEAR;
-    break;
-  case Minicap::METHOD_SCREENSHOT:
-    quirks |= QUIRK_DUMB;
-    break;
-  case Minicap::METHOD_VIRTUAL_DISPLAY:
-    quirks |= QUIRK_ALWAYS_UPRIGHT;
-    break;
-  }
+  // The first display is the primary one: -P describes it, and it's the one
+  // screenshots, recordings and the flight recorder are taken from. The
+  // others are measured themselves and only stream.
+  std::vector<DisplayStream*> streams;
+  std::vector<std::thread> threads;
+  FramePool framePool(8 * displays.size());
+  Recorder* recorder = NULL;
+  FlightRecorder* flightRecorder = NULL;
+  RtpSender* rtpSender = NULL;
+  MetricsServer* metricsServer = NULL;
+  WorkerPool* workerPool = NULL;
+  DisplayStream* primary = NULL;
+  int result = EXIT_FAILURE;
+
+  for (size_t i = 0; i < displays.size(); ++i) {
+    const DisplaySpec& spec = displays[i];
+
+    DisplayConfig config;
+    config.displayId = spec.id;
+    config.sockname = sockname;
+    config.port = spec.port > 0 ? spec.port : DEFAULT_PORT + i;
+    config.format = spec.format >= 0 ? spec.format : format;
+    config.scaling = spec.scaling > 0 ? spec.scaling : scaling;
+    config.realInfo = realInfo;
+    config.desiredInfo = desiredInfo;
+    config.framebufferPath = NULL;
+    config.needsYuv = true;
+    config.prefetch = true;
+    config.frameHeaders = frameHeaders;
+    config.compress = compress;
+    config.detectScroll = detectScroll;
+    config.stripRows = stripRows;
+    config.quality = quality;
+    config.targetLatency = targetLatency;
+    config.pull = pull;
+    config.detachAfter = detachAfter;
+    config.renditions = renditions;
+
+    if (i == 0) {
+      config.crop = crop;
+      config.framebufferPath = framebufferPath;
+      // PNG and JPG screenshots are encoded straight from the frame.
+      config.needsYuv = !takeScreenshot || screenshotFormat == ScreenshotEncoder::FORMAT_YUV;
+      // A single screenshot has nothing to overlap with.
+      config.prefetch = !takeScreenshot || burstCount != 0;
+    }
+    else {
+      Minicap::DisplayInfo info;
+      if (minicap_try_get_display_info(spec.id, &info) != 0) {
+        MCERROR("Unable to get info for display %d", spec.id);
+        goto disaster;
+      }
 
-  if (minicap->setRealInfo(realInfo) != 0) {
-    MCERROR("Minicap did not accept real display info");
-    goto disaster;
-  }
+      config.realInfo.width = config.desiredInfo.width = info.width;
+      config.realInfo.height = config.desiredInfo.height = info.height;
+      config.desiredInfo.orientation = info.orientation;
+    }
 
-  if (minicap->setDesiredInfo(desiredInfo) != 0) {
-    MCERROR("Minicap did not accept desired display info");
-    goto disaster;
-  }
+    const char* conflict = DisplayStream::checkConfig(config);
+    if (conflict != NULL) {
+      std::cerr << "ERROR: " << conflict << std::endl;
+      goto disaster;
+    }
 
-  minicap->setFrameAvailableListener(&gWaiter);
+    DisplayStream* stream = new DisplayStream(config, framePool);
+    streams.push_back(stream);
 
-  if (minicap->applyConfigChanges() != 0) {
-    MCERROR("Unable to start minicap with current config");
-    goto disaster;
-  }
+    if (!stream->setUp()) {
+      goto disaster;
+    }
 
-  //if (!encoder.reserveData(realInfo.width, realInfo.height)) {
-  if(!encoder.reserveData(realInfo.width, realInfo.height, scaling)){
-    MCERROR("Unable to reserve data for JPG encoder");
-    goto disaster;
+    if (i == 0) {
+      primary = stream;
+
+      // Screenshots and tests only ever look at the primary display.
+      if (takeScreenshot || testOnly) {
+        break;
+      }
+    }
   }
 
   if (takeScreenshot) {
-    if (!gWaiter.waitForFrame()) {
-      MCERROR("Unable to wait for frame");
-      goto disaster;
-    }
+    ScreenshotEncoder screenshot(screenshotFormat, quality, primary->getEncoder());
+    Minicap* minicap = primary->getMinicap();
 
-    int err;
-    if ((err = minicap->consumePendingFrame(&frame)) != 0) {
-      MCERROR("Unable to consume pending frame");
-      goto disaster;
+    if (burstCount != 0) {
+      result = run_burst(minicap, primary->getWaiter(), screenshot, crop, burstCount, burstInterval);
+      goto cleanup;
     }
 
-    if (!encoder.encode(&frame)) {
-      MCERROR("Unable to encode frame");
+    if (!primary->getWaiter().waitForFrame()) {
+      MCERROR("Unable to wait for frame");
       goto disaster;
     }
 
-/*
-    YUVEncoder yuv = YUVEncoder();
-    yuv.reserveData(1080, 1920, 0.3);
-    yuv.encode(&frame);
-    if (pumpf(STDOUT_FILENO, yuv.nvFrame.data, yuv.nvFrame.size) < 0) {
-      MCERROR("Unable to output encoded frame data");
+    Minicap::Frame frame;
+    if (minicap->consumePendingFrame(&frame) != 0) {
+      MCERROR("Unable to consume pending frame");
       goto disaster;
     }
-  */  
+
     MCERROR("Capture Screen!");
-    if (pumpf(STDOUT_FILENO, encoder.getEncodedData(), encoder.getEncodedSize()) < 0) {
+
+    bool encoded = screenshot.encode(&frame, crop) &&
+      pumpf(STDOUT_FILENO, screenshot.getEncodedData(), screenshot.getEncodedSize()) >= 0;
+
+    minicap->releaseConsumedFrame(&frame);
+
+    if (!encoded) {
       MCERROR("Unable to output encoded frame data");
       goto disaster;
     }
-    
-    return EXIT_SUCCESS;
+
+    result = EXIT_SUCCESS;
+    goto cleanup;
   }
 
   if (testOnly) {
-    if (gWaiter.waitForFrame() <= 0) {
+    if (primary->getWaiter().waitForFrame() <= 0) {
       MCERROR("Did not receive any frames");
       std::cout << "FAIL" << std::endl;
-      return EXIT_FAILURE;
+      goto disaster;
     }
 
-    minicap_free(minicap);
     std::cout << "OK" << std::endl;
-    return EXIT_SUCCESS;
+    result = EXIT_SUCCESS;
+    goto cleanup;
   }
 
-  if (!server.start(sockname)) {
-    MCERROR("Unable to start server on namespace '%s'", sockname);
-    goto disaster;
+  // One pool for all displays, their batches interleave.
+  if (compress) {
+    workerPool = new WorkerPool();
   }
 
-  // Prepare banner for clients.
-  unsigned char banner[BANNER_SIZE];
-  banner[0] = (unsigned char) BANNER_VERSION;
-  banner[1] = (unsigned char) BANNER_SIZE;
-  putUInt32LE(banner + 2, getpid());
-  putUInt32LE(banner + 6,  realInfo.width);
-  putUInt32LE(banner + 10,  realInfo.height);
-  putUInt32LE(banner + 14, desiredInfo.width);
-  putUInt32LE(banner + 18, desiredInfo.height);
-  banner[22] = (unsigned char) desiredInfo.orientation;
-  banner[23] = quirks;
-
-  int fd;
-  while (!gWaiter.isStopped() && (fd = server.accept()) > 0) {
-    MCINFO("New client connection");
-
-	
-    if (pumps(fd, banner, BANNER_SIZE) < 0) {
-      close(fd);
-      continue;
-    }
-
-    int pending, err;
-    while (!gWaiter.isStopped() && (pending = gWaiter.waitForFrame()) > 0) {
-      if (skipFrames && pending > 1) {
-        // Skip frames if we have too many. Not particularly thread safe,
-        // but this loop should be the only consumer anyway (i.e. nothing
-        // else decreases the frame count).
-        gWaiter.reportExtraConsumption(pending - 1);
-
-        while (--pending >= 1) {
-          if ((err = minicap->consumePendingFrame(&frame)) != 0) {
-            if (err == -EINTR) {
-              MCINFO("Frame consumption interrupted by EINTR");
-              goto close;
-            }
-            else {
-              MCERROR("Unable to skip pending frame");
-              goto disaster;
-            }
-          }
-
-          minicap->releaseConsumedFrame(&frame);
-        }
-      }
-
-      if ((err = minicap->consumePendingFrame(&frame)) != 0) {
-        if (err == -EINTR) {
-          MCINFO("Frame consumption interrupted by EINTR");
-          goto close;
-        }
-        else {
-          MCERROR("Unable to consume pending frame");
-          goto disaster;
-        }
-      }
+  for (auto stream: streams) {
+    stream->setWorkerPool(workerPool);
 
-      haveFrame = true;
+    if (!stream->listen()) {
+      goto disaster;
+    }
+  }
 
-      // Encode the frame.
-      if (!encoder.encode(&frame/*, quality*/)) {
-        MCERROR("Unable to encode frame");
-        goto disaster;
-      }
+  if (recordDir != NULL) {
+    recorder = new Recorder(recordDir, segmentSeconds);
 
-      // Push it out synchronously because it's fast and we don't care
-      // about other clients.
-      unsigned char* data = encoder.getEncodedData();// - 4;
-      size_t size = encoder.getEncodedSize();
-
-      //pumpf(STDOUT_FILENO, data, size);
-	  unsigned char* len = new unsigned char[4];
-	  putUInt32LE(len,size);
-	  
-	  if(pumps(fd,len,4) < 0){
-		break;
-	  }
-	  
-	  if(pumps(fd, data, size/*+ 4*/) < 0) {
-        break;
-      }
-	   
+    // Recordings always carry frame headers.
+    unsigned char recordBanner[BANNER_SIZE];
+    memcpy(recordBanner, primary->getBanner(), BANNER_SIZE);
+    recordBanner[24] |= BANNER_FLAG_FRAME_HEADER;
 
-      // This will call onFrameAvailable() on older devices, so we have
-      // to do it here or the loop will stop.
-      minicap->releaseConsumedFrame(&frame);
-      haveFrame = false;
+    if (!recorder->start(recordBanner, BANNER_SIZE)) {
+      goto disaster;
     }
 
-close:
-    MCINFO("Closing client connection");
-    close(fd);
+    primary->setRecorder(recorder);
+  }
+
+  if (flightMegabytes > 0) {
+    flightRecorder = new FlightRecorder(flightMegabytes * 1024 * 1024, flightSeconds,
+      flightDir != NULL ? flightDir : "");
+    primary->setFlightRecorder(flightRecorder);
+  }
+
+  if (udpHost != NULL) {
+    rtpSender = new RtpSender(udpHost, udpPort, udpKbps);
 
-    // Have we consumed one frame but are still holding it?
-    if (haveFrame) {
-      minicap->releaseConsumedFrame(&frame);
+    if (!rtpSender->start()) {
+      goto disaster;
     }
+
+    primary->setRtpSender(rtpSender);
   }
 
-  minicap_free(minicap);
+  if (metricsPort > 0) {
+    metricsServer = new MetricsServer();
 
-  return EXIT_SUCCESS;
+    if (!metricsServer->start(metricsPort)) {
+      goto disaster;
+    }
+  }
+
+  for (size_t i = 1; i < streams.size(); ++i) {
+    threads.push_back(std::thread([](DisplayStream* stream) {
+      if (!stream->run()) {
+        FrameWaiter::stopAll();
+      }
+    }, streams[i]));
+  }
+
+  result = primary->run() ? EXIT_SUCCESS : EXIT_FAILURE;
+  goto cleanup;
 
 disaster:
-  if (haveFrame) {
-    minicap->releaseConsumedFrame(&frame);
+  result = EXIT_FAILURE;
+
+cleanup:
+  // Whatever ended the primary stream ends the others, too.
+  FrameWaiter::stopAll();
+
+  for (auto& thread: threads) {
+    thread.join();
+  }
+
+  gTracer.stop();
+
+  delete recorder;
+  delete flightRecorder;
+  delete rtpSender;
+  delete metricsServer;
+
+  for (auto stream: streams) {
+    delete stream;
   }
 
-  minicap_free(minicap);
+  delete workerPool;
 
-  return EXIT_FAILURE;
+  return result;
 }